@@ -7,6 +7,7 @@
 #define TLSF_CREATE_LOCK(l)     pthread_mutex_init (l, NULL)
 #define TLSF_DESTROY_LOCK(l)    pthread_mutex_destroy(l)
 #define TLSF_ACQUIRE_LOCK(l)    pthread_mutex_lock(l)
+#define TLSF_TRY_ACQUIRE_LOCK(l) (pthread_mutex_trylock(l) == 0)
 #define TLSF_RELEASE_LOCK(l)    pthread_mutex_unlock(l)
 
 #endif
@@ -1,15 +1,75 @@
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <assert.h>
 #include <limits.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "tlsf.h"
 #include "asan.h"
+#include "target.h"
 
-#if HAVE_CONFIG_H
-#include "config.h"
+#if HAVE_SCHED_GETCPU
+#include <sched.h>
+#endif
+
+#if HAVE_MMAP || HAVE_MADVISE || HAVE_MLOCK
+#include <sys/mman.h>
+#endif
+
+#if HAVE_MADVISE
+#include <unistd.h>
+#endif
+
+#if defined (__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* Maintain the counters reported by tlsf_get_stats */
+#ifndef TLSF_STATISTIC
+#define TLSF_STATISTIC (0)
+#endif
+
+/* Leave the heap out of block headers, and find it from the pool instead */
+#ifndef TLSF_COMPACT_HEADER
+#define TLSF_COMPACT_HEADER (0)
+#endif
+
+/* Link large free blocks through a table at the end of each pool */
+#ifndef TLSF_OOB_LINKS
+#define TLSF_OOB_LINKS (0)
+#endif
+
+/* Store the free list heads as 32-bit offsets from the control structure */
+#ifndef TLSF_COMPACT_CONTROL
+#define TLSF_COMPACT_CONTROL (0)
+#endif
+
+/*
+ * Size class configuration, see enum tlsf_public. Builds with different
+ * settings can be linked into one program when each is given its own
+ * TLSF_PREFIX, see tlsf.h.
+ */
+#ifndef TLSF_SL_INDEX_COUNT_LOG2
+#define TLSF_SL_INDEX_COUNT_LOG2 (5)
+#endif
+
+/* Name reported by tlsf_get_variant */
+#define TLSF_STRINGIFY_(x) #x
+#define TLSF_STRINGIFY(x) TLSF_STRINGIFY_(x)
+#ifndef TLSF_VARIANT_NAME
+#if defined (TLSF_PREFIX)
+#define TLSF_VARIANT_NAME TLSF_STRINGIFY(TLSF_PREFIX)
+#else
+#define TLSF_VARIANT_NAME "tlsf"
+#endif
 #endif
 
 /*
@@ -39,12 +99,17 @@
 #define TLSF_64BIT
 #endif
 
-#if HAVE___BUILTIN_FFS && HAVE___BUILTIN_CLZL
+#if HAVE___BUILTIN_FFS && HAVE___BUILTIN_FFSL && HAVE___BUILTIN_CLZL
 static int tlsf_ffs(unsigned int word)
 {
 	return __builtin_ffs(word) - 1;
 }
 
+static int tlsf_ffs_sizet(size_t word)
+{
+	return __builtin_ffsl((long)word) - 1;
+}
+
 static int tlsf_fls_sizet(size_t word)
 {
 	const int ulong_bits = 8 * sizeof(unsigned long);
@@ -75,6 +140,16 @@ static int tlsf_ffs(unsigned int word)
 }
 
 #if defined (TLSF_64BIT)
+static int tlsf_ffs_sizet(size_t word)
+{
+	const unsigned int low = (unsigned int)word;
+	const unsigned int high = (unsigned int)(word >> 32);
+	if (low) {
+		return tlsf_ffs(low);
+	}
+	return high ? 32 + tlsf_ffs(high) : -1;
+}
+
 static int tlsf_fls_sizet(size_t size)
 {
 	int high = (int)(size >> 32);
@@ -88,6 +163,7 @@ static int tlsf_fls_sizet(size_t size)
 	return bits;
 }
 #else
+#define tlsf_ffs_sizet tlsf_ffs
 #define tlsf_fls_sizet tlsf_fls
 #endif
 
@@ -101,14 +177,86 @@ static int tlsf_fls_sizet(size_t size)
 enum tlsf_public {
 	/* log2 of number of linear subdivisions of block sizes. Larger
 	 * values require more memory in the control structure. Values of
-	 * 4 or 5 are typical.
+	 * 4 or 5 are typical; 6 needs a 64-bit target. Set with
+	 * TLSF_SL_INDEX_COUNT_LOG2.
+	 */
+	SL_INDEX_COUNT_LOG2 = TLSF_SL_INDEX_COUNT_LOG2,
+
+	/* Thread caches keep magazines for the classes of the first
+	 * CACHE_FL_COUNT first-level lists, each holding up to
+	 * CACHE_MAGAZINE_SIZE blocks. Half a magazine is moved to or from
+	 * the heap at a time.
+	 */
+	CACHE_FL_COUNT = 3,
+	CACHE_MAGAZINE_SIZE = 16,
+
+	/* Deferred coalescing keeps quick lists for the classes of the first
+	 * QUICK_FL_COUNT first-level lists, see tlsf_set_quick.
+	 */
+	QUICK_FL_COUNT = 4,
+
+	/* With TLSF_OOB_LINKS, free blocks of at least
+	 * 1 << LINK_GRANULE_LOG2 bytes are linked through the link table of
+	 * their pool, which has an entry per granule of the pool.
+	 */
+	LINK_GRANULE_LOG2 = 12,
+
+	/* Upper bound on the adaptive spinning of locked heaps before they
+	 * block on the lock.
+	 */
+	LOCK_SPIN_MAX = 1000,
+
+	/* log2 of the size of a slab page, see tlsf_slab_enable */
+	SLAB_PAGE_SIZE_LOG2 = 12,
+
+	/* The region registry maps aligned granules of 1 << REGION_GRANULE_LOG2
+	 * bytes to their heap, through three levels of 1 << REGION_LEVEL_BITS
+	 * entries, which cover 48-bit addresses.
+	 */
+	REGION_GRANULE_LOG2 = 12,
+	REGION_LEVEL_BITS = 12,
+
+	/* Growing heaps map their first pool with the default size, and
+	 * round the size of each pool up to the granule.
 	 */
-	SL_INDEX_COUNT_LOG2 = 5,
+	GROW_SIZE_DEFAULT_LOG2 = 20,
+	GROW_GRANULE_LOG2 = 12,
+
+	/* log2 of the huge page size that TLSF_MAP_HUGETLB pools are
+	 * rounded up to.
+	 */
+	HUGE_PAGE_SIZE_LOG2 = 21,
+
+	/* With TLSF_COMPACT_CONTROL, pools mapped by the default provider are
+	 * placed with up to GROW_NEAR_TRIES address hints on either side of
+	 * the control structure, so that they are within reach of its heads.
+	 */
+	GROW_NEAR_TRIES = 8,
+
+	/* Address-ordered placement sorts a freed block into the first
+	 * PLACE_SCAN_MAX blocks of its free list, and appends it after them
+	 * otherwise.
+	 */
+	PLACE_SCAN_MAX = 8,
+
+	/* tlsf_memalign looks at up to ALIGN_PROBE_MAX free blocks from the
+	 * size class of the request for one that holds an aligned block,
+	 * before asking for a block with room for any alignment gap.
+	 */
+	ALIGN_PROBE_MAX = 8,
+
+	/* tlsf_calloc clears at least 1 << ZERO_STREAM_SIZE_LOG2 bytes with
+	 * non-temporal stores where available, bypassing the cache.
+	 */
+	ZERO_STREAM_SIZE_LOG2 = 18,
 };
 
 /* Private constants: do not modify */
 enum tlsf_private {
-#if defined (TLSF_64BIT)
+#if defined (TLSF_ALIGN_SIZE_LOG2)
+	/* Set at build time, at most the size of the block metadata */
+	ALIGN_SIZE_LOG2 = TLSF_ALIGN_SIZE_LOG2,
+#elif defined (TLSF_64BIT)
 	/* All allocation sizes and addresses are aligned to 8 bytes */
 	ALIGN_SIZE_LOG2 = 3,
 #else
@@ -128,7 +276,10 @@ enum tlsf_private {
 	 * blocks below that size into the 0th first-level list.
 	 */
 
-#if defined (TLSF_64BIT)
+#if defined (TLSF_FL_INDEX_MAX)
+	/* Set at build time, see the static assertions for the limits */
+	FL_INDEX_MAX = TLSF_FL_INDEX_MAX,
+#elif defined (TLSF_64BIT)
 	/*
 	 * Increased this (from 32 to 40) to support larger sizes, at the expense
 	 * of more overhead in the TLSF structure.
@@ -142,8 +293,34 @@ enum tlsf_private {
 	FL_INDEX_COUNT = (FL_INDEX_MAX - FL_INDEX_SHIFT + 1),
 
 	SMALL_BLOCK_SIZE = (1 << FL_INDEX_SHIFT),
+
+	GROW_SIZE_DEFAULT = (1 << GROW_SIZE_DEFAULT_LOG2),
+	GROW_GRANULE = (1 << GROW_GRANULE_LOG2),
+	HUGE_PAGE_SIZE = (1 << HUGE_PAGE_SIZE_LOG2),
+	ZERO_STREAM_SIZE = (1 << ZERO_STREAM_SIZE_LOG2),
+
+	QUICK_CLASS_COUNT = QUICK_FL_COUNT * SL_INDEX_COUNT,
+
+	/* First-level lists whose blocks are linked through the link table */
+	LINK_GRANULE = (1 << LINK_GRANULE_LOG2),
+	LINK_FL_MIN = LINK_GRANULE_LOG2 - FL_INDEX_SHIFT + 1,
+
+	REGION_GRANULE = (1 << REGION_GRANULE_LOG2),
+	REGION_FANOUT = (1 << REGION_LEVEL_BITS),
+
+	/* Block headers are word aligned, list heads count in words */
+	HEAD_UNIT = sizeof(void *),
 };
 
+/* 64 second-level lists need a 64-bit bitmap */
+#if TLSF_SL_INDEX_COUNT_LOG2 > 5
+typedef size_t sl_bitmap_t;
+#define tlsf_ffs_sl tlsf_ffs_sizet
+#else
+typedef unsigned int sl_bitmap_t;
+#define tlsf_ffs_sl tlsf_ffs
+#endif
+
 /*
  * Cast and min/max macros.
  */
@@ -152,6 +329,17 @@ enum tlsf_private {
 #define tlsf_min(a, b)		((a) < (b) ? (a) : (b))
 #define tlsf_max(a, b)		((a) > (b) ? (a) : (b))
 
+/*
+ * Update a counter of tlsf_get_stats, if they are compiled in.
+ */
+#if TLSF_STATISTIC
+#define tlsf_stat_add(tlsf, field, n) ((tlsf)->field += (n))
+#define tlsf_stat_sub(tlsf, field, n) ((tlsf)->field -= (n))
+#else
+#define tlsf_stat_add(tlsf, field, n) ((void)0)
+#define tlsf_stat_sub(tlsf, field, n) ((void)0)
+#endif
+
 /*
  * Set assert macro, if it has not been provided by the user.
  */
@@ -174,11 +362,29 @@ tlsf_static_assert(sizeof(size_t) * CHAR_BIT >= 32);
 tlsf_static_assert(sizeof(size_t) * CHAR_BIT <= 64);
 
 /* SL_INDEX_COUNT must be <= number of bits in sl_bitmap's storage type */
-tlsf_static_assert(sizeof(unsigned int) * CHAR_BIT >= SL_INDEX_COUNT);
+tlsf_static_assert(sizeof(sl_bitmap_t) * CHAR_BIT >= SL_INDEX_COUNT);
+
+/* FL_INDEX_COUNT must be <= number of bits in fl_bitmap's storage type */
+tlsf_static_assert(sizeof(size_t) * CHAR_BIT >= FL_INDEX_COUNT);
+
+/* Leave headroom for rounding requests up to the largest block size */
+tlsf_static_assert(FL_INDEX_MAX > FL_INDEX_SHIFT);
+tlsf_static_assert(sizeof(size_t) * CHAR_BIT - 2 >= FL_INDEX_MAX);
 
 /* Ensure we've properly tuned our sizes */
 tlsf_static_assert(ALIGN_SIZE == SMALL_BLOCK_SIZE / SL_INDEX_COUNT);
 
+/* Thread caches must not cover more classes than the heap has */
+tlsf_static_assert(CACHE_FL_COUNT > 0 && tlsf_cast(int, CACHE_FL_COUNT) <= FL_INDEX_COUNT);
+tlsf_static_assert(CACHE_MAGAZINE_SIZE >= 2);
+tlsf_static_assert(QUICK_FL_COUNT > 0 && tlsf_cast(int, QUICK_FL_COUNT) <= FL_INDEX_COUNT);
+tlsf_static_assert(LINK_FL_MIN > 0 && tlsf_cast(int, LINK_FL_MIN) < FL_INDEX_COUNT);
+/*
+ * One link table entry per LINK_GRANULE is enough when the smallest block
+ * linked through the table, mapping_size(LINK_FL_MIN, 0), spans a granule.
+ */
+tlsf_static_assert((tlsf_cast(size_t, 1) << (LINK_FL_MIN + FL_INDEX_SHIFT - 1)) >= LINK_GRANULE);
+
 /*
  * Data structures and associated constants.
  */
@@ -206,8 +412,10 @@ typedef struct block_header {
  		 */
 		size_t size;
 
+#if !TLSF_COMPACT_HEADER
 		/* The heap this allocation belongs to */
 		tlsf_t *tlsf;
+#endif
 	} metadata;
 
 	struct free_list {
@@ -217,14 +425,47 @@ typedef struct block_header {
 	} free_list;
 } block_header_t;
 
+/*
+ * Link table entry. With TLSF_OOB_LINKS, a large free block keeps only a
+ * pointer to its entry in next_free, and a NULL prev_free. The entries of
+ * a free list link to each other and hold the address and size of their
+ * block, so that removing a block never touches its neighbours on the
+ * list, and walking a list stays in the table. Each pool brings an entry
+ * per LINK_GRANULE bytes, so there is always one for each block of that
+ * size. Unused entries have no block.
+ *
+ * Two words of a large free block are still written in place: the entry
+ * pointer right after its header, and the prev_phys_block trailer right
+ * before the next header. Both sit in the pages of headers that change
+ * anyway, which block_purge never purges, so the pages in between stay
+ * untouched while the block is free and MADV_FREE does not refault them.
+ * Moving them into the table would take a lookup from a block to its
+ * pool on every free.
+ */
+typedef struct free_link {
+	struct free_link *next;
+	struct free_link *prev;
+	block_header_t *block;
+	size_t size;
+} free_link_t;
+
 /*
  * Since block sizes are always at least a multiple of 4, the two least
  * significant bits of the size field are used to store the block status:
  * - bit 0: whether block is busy or free
  * - bit 1: whether previous block is busy or free
+ * On 64-bit targets sizes are multiples of 8, which leaves room for:
+ * - bit 2: whether the pages inside the block were purged by tlsf_trim,
+ *   or come from a zero filled pool, and have not been written since;
+ *   only ever set on free blocks
  */
 static const size_t block_header_free_bit = 1 << 0;
 static const size_t block_header_prev_free_bit = 1 << 1;
+#if defined (TLSF_64BIT)
+static const size_t block_header_purged_bit = 1 << 2;
+#else
+static const size_t block_header_purged_bit = 0;
+#endif
 
 /*
  * The size of the block header exposed to used blocks is the size field.
@@ -247,36 +488,176 @@ static const size_t block_start_offset = offsetof(block_header_t, free_list);
  * the metadata, and no larger than the number of addressable
  * bits for FL_INDEX.
  */
-static const size_t block_size_min = sizeof(block_header_t) - sizeof(struct metadata);
+static const size_t block_size_min =
+	(sizeof(block_header_t) - sizeof(struct metadata) + ALIGN_SIZE - 1) & ~(tlsf_cast(size_t, ALIGN_SIZE) - 1);
 static const size_t block_size_max = tlsf_cast(size_t, 1) << FL_INDEX_MAX;
 
 
+/*
+ * Slab page header. Slabs hold objects of a single size class below
+ * SMALL_BLOCK_SIZE, without a block header per object. A set bit in the
+ * map marks a free object.
+ */
+enum tlsf_slab_private {
+	SLAB_PAGE_SIZE = 1 << SLAB_PAGE_SIZE_LOG2,
+	SLAB_MAP_WORDS = SLAB_PAGE_SIZE / ALIGN_SIZE / 32,
+};
+
+/* Slab arenas cover whole granules of the region registry */
+tlsf_static_assert(SLAB_PAGE_SIZE % REGION_GRANULE == 0);
+
+typedef struct slab {
+	/* Partial slabs of the same class, or free pages of the arena */
+	struct slab *next;
+	struct slab *prev;
+
+	unsigned int size;
+	unsigned int count;
+	unsigned int free;
+	unsigned int map[SLAB_MAP_WORDS];
+} slab_t;
+
+/*
+ * Pool header. Each pool starts with a record linking it into the pools
+ * of its heap, so that pools obtained from a region provider can be
+ * returned to it.
+ */
+typedef struct pool_header {
+	_Alignas(ALIGN_SIZE) struct pool_header *next;
+	/* Size passed to tlsf_add_pool, including this header */
+	size_t bytes;
+	/* Nonzero if the pool was mapped by the heap's region provider */
+	size_t mapped;
+} pool_header_t;
+
+tlsf_static_assert(sizeof(pool_header_t) % ALIGN_SIZE == 0);
+
+/*
+ * Huge block header. A huge allocation has a mapping of its own, holding
+ * a used block with the prev_free bit set but no previous block, and this
+ * record right before it. Pool blocks never look like that: the first
+ * block of a pool always has a used previous block.
+ */
+typedef struct huge_header {
+	/* Start and size of the mapping */
+	void *map;
+	size_t bytes;
+	/* Heap the allocation was made from */
+	tlsf_t *tlsf;
+} huge_header_t;
+
+/* User pointers stay aligned only if the metadata record is */
+tlsf_static_assert(sizeof(struct metadata) % ALIGN_SIZE == 0);
+tlsf_static_assert(ALIGN_SIZE >= sizeof(void *));
+
 /* The TLSF control structure */
+/*
+ * Free list heads. With TLSF_COMPACT_CONTROL they are stored as signed
+ * offsets from the control structure, in units of HEAD_UNIT bytes, which
+ * halves the largest part of the control structure. Pools must then lie
+ * within head_reach bytes of it.
+ */
+#if TLSF_COMPACT_CONTROL
+typedef int32_t list_head_t;
+#else
+typedef block_header_t *list_head_t;
+#endif
+
+static const size_t head_reach = tlsf_cast(size_t, INT32_MAX) * HEAD_UNIT;
+
+/*
+ * The bitmaps come first, followed by the heads of the small classes, so
+ * that a request that is served from its own size class stays within the
+ * first cache lines of the control structure.
+ */
 struct tlsf {
+	/* Bitmaps for free lists, aligned so that the size pads to ALIGN_SIZE */
+	_Alignas(ALIGN_SIZE) size_t fl_bitmap;
+	sl_bitmap_t sl_bitmap[FL_INDEX_COUNT];
+
+	/* Head of free lists, see list_head */
+	list_head_t blocks[FL_INDEX_COUNT][SL_INDEX_COUNT];
+
 	/* Empty lists point at this block to indicate they are free */
 	block_header_t block_null;
 
-	/* Bitmaps for free lists */
-	unsigned int fl_bitmap;
-	unsigned int sl_bitmap[FL_INDEX_COUNT];
+#if TLSF_OOB_LINKS
+	/* Ends of the lists of link table entries, and the unused entries */
+	free_link_t link_null;
+	free_link_t *links_free;
+#endif
 
-	/* Head of free lists */
-	block_header_t *blocks[FL_INDEX_COUNT][SL_INDEX_COUNT];
+	/* Blocks freed by other threads, waiting for the owner to release */
+	_Atomic(block_header_t *) remote_free;
+
+	/* Arena of slab pages for small allocations, see tlsf_slab_enable */
+	char *slab_start;
+	char *slab_end;
+	char *slab_bump;
+	slab_t *slab_pages;
+	slab_t *slab_partial[SL_INDEX_COUNT];
+
+	/* Pools of this heap and their total size */
+	pool_header_t *pools;
+	size_t pool_bytes;
+
+	/* Source of new pools when the heap runs out, see tlsf_set_provider */
+	tlsf_map_fn map;
+	tlsf_unmap_fn unmap;
+	void *map_user;
+	size_t grow_next;
+	size_t grow_max;
+	unsigned int grow_factor;
+
+	/* Placement tuning, see tlsf_set_fit and tlsf_set_placement */
+	unsigned int fit_probe;
+	size_t split_min;
+	int placement;
+
+	/* Requests served from a mapping of their own, see tlsf_set_huge */
+	size_t huge_threshold;
+
+	/* Used blocks waiting to be coalesced, see tlsf_set_quick */
+	block_header_t *quick[QUICK_CLASS_COUNT];
+	unsigned int quick_count[QUICK_CLASS_COUNT];
+	unsigned int quick_max;
+	size_t quick_bytes;
+	size_t quick_bytes_max;
+
+	/* Lock around the public entry points, see tlsf_create_locked */
+	int locked;
+	atomic_int spin_limit;
+	TLSF_MLOCK_T lock;
+	tlsf_lock_stats_t lock_stats;
+
+#if TLSF_STATISTIC
+	/* Counters of tlsf_get_stats, except for the derived used bytes */
+	tlsf_stats_t stats;
+
+	/* Free blocks and bytes per free list, see tlsf_census */
+	size_t census_blocks[FL_INDEX_COUNT][SL_INDEX_COUNT];
+	size_t census_bytes[FL_INDEX_COUNT][SL_INDEX_COUNT];
+#endif
 };
 
+/* A pool placed behind the control structure must stay aligned */
+tlsf_static_assert(sizeof(tlsf_t) % ALIGN_SIZE == 0);
+
 /*
  * block_header_t member functions.
  */
 
 static size_t block_size(const block_header_t *block)
 {
-	return block->metadata.size & ~(block_header_free_bit | block_header_prev_free_bit);
+	return block->metadata.size & ~(block_header_free_bit | block_header_prev_free_bit
+		| block_header_purged_bit);
 }
 
 static void block_set_size(block_header_t *block, size_t size)
 {
 	const size_t oldsize = block->metadata.size;
-	block->metadata.size = size | (oldsize & (block_header_free_bit | block_header_prev_free_bit));
+	block->metadata.size = size | (oldsize & (block_header_free_bit | block_header_prev_free_bit
+		| block_header_purged_bit));
 }
 
 static int block_is_last(const block_header_t *block)
@@ -314,6 +695,93 @@ static void block_set_prev_used(block_header_t *block)
 	block->metadata.size &= ~block_header_prev_free_bit;
 }
 
+static int block_is_purged(const block_header_t *block)
+{
+	return tlsf_cast(int, block->metadata.size & block_header_purged_bit) != 0;
+}
+
+static void block_set_purged(block_header_t *block, int purged)
+{
+	if (purged) {
+		block->metadata.size |= block_header_purged_bit;
+	} else {
+		block->metadata.size &= ~block_header_purged_bit;
+	}
+}
+
+/* Huge blocks, see huge_header_t */
+// ASAN pre: poisoned metadata: block
+// ASAN temporarily unpoisons metadata and trailer, huge blocks are never poisoned
+static int block_is_huge(const block_header_t *block)
+{
+	int huge = 0;
+
+	ASAN_UNPOISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+	if (block_is_prev_free(block)) {
+		ASAN_UNPOISON_MEMORY_REGION(&block->prev_trailer, sizeof(struct trailer));
+		huge = block->prev_trailer.prev_phys_block == NULL;
+		if (!huge) {
+			ASAN_POISON_MEMORY_REGION(&block->prev_trailer, sizeof(struct trailer));
+		}
+	}
+	if (!huge) {
+		ASAN_POISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+	}
+	return huge;
+}
+
+static huge_header_t *block_huge(const block_header_t *block)
+{
+	return tlsf_cast(huge_header_t *, block) - 1;
+}
+
+/*
+ * The heap a block belongs to. Compact headers leave it out, and it is
+ * found from the registered range of the pool instead, or from the
+ * header of a huge block.
+ */
+#if TLSF_COMPACT_HEADER
+static tlsf_t *region_lookup(const void *ptr);
+
+static tlsf_t *block_heap(const block_header_t *block)
+{
+	tlsf_t *tlsf = region_lookup(block);
+	if (tlsf == NULL && block_is_huge(block)) {
+		tlsf = block_huge(block)->tlsf;
+	}
+	return tlsf;
+}
+
+static void block_set_heap(block_header_t *block, tlsf_t *tlsf)
+{
+	(void)block;
+	(void)tlsf;
+}
+
+static void block_inherit_heap(block_header_t *block, const block_header_t *from)
+{
+	(void)block;
+	(void)from;
+}
+#else
+// Not sanitized, see tlsf_from_ptr
+ASAN_NO_SANITIZE_ADDRESS
+static tlsf_t *block_heap(const block_header_t *block)
+{
+	return block->metadata.tlsf;
+}
+
+static void block_set_heap(block_header_t *block, tlsf_t *tlsf)
+{
+	block->metadata.tlsf = tlsf;
+}
+
+static void block_inherit_heap(block_header_t *block, const block_header_t *from)
+{
+	block->metadata.tlsf = from->metadata.tlsf;
+}
+#endif
+
 static block_header_t *block_from_ptr(const void *ptr)
 {
 	return tlsf_cast(block_header_t *,
@@ -326,10 +794,11 @@ static void *block_to_ptr(const block_header_t *block)
 		tlsf_cast(unsigned char *, block) + block_start_offset);
 }
 
-/* Return first block of pool */
+/* Return first block of pool, past the pool header */
 static block_header_t *first_block(const void *ptr)
 {
-	return tlsf_cast(block_header_t *, tlsf_cast(ptrdiff_t, ptr) - trailer_size);
+	return tlsf_cast(block_header_t *,
+		tlsf_cast(ptrdiff_t, ptr) + sizeof(pool_header_t) - trailer_size);
 }
 
 /* Return location of previous block */
@@ -387,6 +856,8 @@ static void block_mark_as_used(block_header_t *block)
 	block_set_prev_used(next);
 	ASAN_POISON_MEMORY_REGION(&next->metadata, sizeof(struct metadata));
 	block_set_used(block);
+	/* Used blocks may be dirty */
+	block_set_purged(block, 0);
 }
 
 static size_t align_up(size_t x, size_t align)
@@ -449,6 +920,79 @@ static void mapping_search(size_t size, int *fli, int *sli)
 	*sli = sl;
 }
 
+/* Round a request up to the next list boundary, as malloc searches */
+static size_t mapping_round(size_t size)
+{
+	if (size >= SMALL_BLOCK_SIZE) {
+		const size_t round = (tlsf_cast(size_t, 1) << (tlsf_fls_sizet(size) - SL_INDEX_COUNT_LOG2)) - 1;
+		size += round;
+	}
+	return size;
+}
+
+/* Smallest block size stored in the given list */
+static size_t mapping_size(int fl, int sl)
+{
+	if (fl == 0) {
+		return tlsf_cast(size_t, sl) * (SMALL_BLOCK_SIZE / SL_INDEX_COUNT);
+	}
+	const int shift = fl + FL_INDEX_SHIFT - 1;
+	return (tlsf_cast(size_t, 1) << shift) + (tlsf_cast(size_t, sl) << (shift - SL_INDEX_COUNT_LOG2));
+}
+
+/*
+ * Head of a free list. Only the heads of lists marked in the bitmaps are
+ * valid, the others may hold anything: control_construct and tlsf_reset
+ * leave them as they are.
+ */
+static block_header_t *list_head(const tlsf_t *tlsf, int fl, int sl)
+{
+	if (!(tlsf->sl_bitmap[fl] & (tlsf_cast(sl_bitmap_t, 1) << sl))) {
+		return tlsf_cast(block_header_t *, &tlsf->block_null);
+	}
+#if TLSF_COMPACT_CONTROL
+	const ptrdiff_t offset = tlsf_cast(ptrdiff_t, tlsf->blocks[fl][sl]) * HEAD_UNIT;
+	return tlsf_cast(block_header_t *, tlsf_cast(void *, tlsf_cast(const char *, tlsf) + offset));
+#else
+	return tlsf->blocks[fl][sl];
+#endif
+}
+
+static void list_set_head(tlsf_t *tlsf, int fl, int sl, block_header_t *block)
+{
+#if TLSF_COMPACT_CONTROL
+	const ptrdiff_t offset = tlsf_cast(char *, block) - tlsf_cast(char *, tlsf);
+	tlsf_assert(offset % HEAD_UNIT == 0 && "block not aligned to a head unit");
+	tlsf_assert(offset / HEAD_UNIT >= INT32_MIN && offset / HEAD_UNIT <= INT32_MAX
+		&& "block out of reach of the control structure");
+	tlsf->blocks[fl][sl] = tlsf_cast(list_head_t, offset / HEAD_UNIT);
+#else
+	tlsf->blocks[fl][sl] = block;
+#endif
+}
+
+/* Whether all blocks of a pool can be list heads */
+static int pool_in_reach(const tlsf_t *tlsf, const void *mem, size_t bytes)
+{
+#if TLSF_COMPACT_CONTROL
+	const char *base = tlsf_cast(const char *, tlsf);
+	const char *start = tlsf_cast(const char *, mem);
+
+	if (bytes > head_reach) {
+		return 0;
+	}
+	if (start >= base) {
+		return tlsf_cast(size_t, start - base) <= head_reach - bytes;
+	}
+	return tlsf_cast(size_t, base - start) <= head_reach;
+#else
+	(void)tlsf;
+	(void)mem;
+	(void)bytes;
+	return 1;
+#endif
+}
+
 static block_header_t *search_suitable_block(tlsf_t *tlsf, int *fli, int *sli)
 {
 	int fl = *fli;
@@ -458,64 +1002,165 @@ static block_header_t *search_suitable_block(tlsf_t *tlsf, int *fli, int *sli)
 	 * First, search for a block in the list associated with the given
 	 * fl/sl index.
 	 */
-	unsigned int sl_map = tlsf->sl_bitmap[fl] & (~0U << sl);
+	sl_bitmap_t sl_map = tlsf->sl_bitmap[fl] & (~tlsf_cast(sl_bitmap_t, 0) << sl);
 	if (sl_map == 0) {
 		/* No block exists. Search in the next largest first-level list */
-		unsigned int fl_map = tlsf->fl_bitmap & (~0U << (fl + 1));
+		size_t fl_map = tlsf->fl_bitmap & (~tlsf_cast(size_t, 0) << (fl + 1));
 		if (fl_map == 0) {
 			/* No free blocks available, memory has been exhausted */
 			return NULL;
 		}
 
-		fl = tlsf_ffs(fl_map);
+		fl = tlsf_ffs_sizet(fl_map);
 		*fli = fl;
 		sl_map = tlsf->sl_bitmap[fl];
 	}
 	tlsf_assert(sl_map && "internal error - second level bitmap is null");
-	sl = tlsf_ffs(sl_map);
+	sl = tlsf_ffs_sl(sl_map);
 	*sli = sl;
 
 	/* Return the first block in the free list */
-	block_header_t *block = tlsf->blocks[fl][sl];
+	block_header_t *block = list_head(tlsf, fl, sl);
 
 	ASAN_UNPOISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
 
 	return block;
 }
 
+/* Next block on the free list of a free block */
+static block_header_t *block_next_free(const block_header_t *block)
+{
+	ASAN_UNPOISON_MEMORY_REGION(&block->free_list, sizeof(struct free_list));
+	block_header_t *next = block->free_list.next_free;
+#if TLSF_OOB_LINKS
+	if (block->free_list.prev_free == NULL) {
+		next = tlsf_cast(free_link_t *, tlsf_cast(void *, next))->next->block;
+	}
+#endif
+	ASAN_POISON_MEMORY_REGION(&block->free_list, sizeof(struct free_list));
+	return next;
+}
+
+#if TLSF_OOB_LINKS
+/* Whether the blocks of a first-level list are linked through the table */
+static int list_in_table(int fl)
+{
+	return fl >= LINK_FL_MIN;
+}
+
+/* Link table entry of a free block, or the end of the list */
+static free_link_t *block_link(tlsf_t *tlsf, const block_header_t *block)
+{
+	free_link_t *link = &tlsf->link_null;
+
+	if (block != &tlsf->block_null) {
+		ASAN_UNPOISON_MEMORY_REGION(&block->free_list, sizeof(struct free_list));
+		tlsf_assert(block->free_list.prev_free == NULL && "block not linked through the table");
+		link = tlsf_cast(free_link_t *, tlsf_cast(void *, block->free_list.next_free));
+		ASAN_POISON_MEMORY_REGION(&block->free_list, sizeof(struct free_list));
+	}
+	return link;
+}
+
+/* Unlink a free block, returning the block that followed it */
+static block_header_t *link_remove(tlsf_t *tlsf, block_header_t *block)
+{
+	free_link_t *link = block_link(tlsf, block);
+
+	link->prev->next = link->next;
+	link->next->prev = link->prev;
+
+	block = link->next->block;
+	link->block = NULL;
+	link->next = tlsf->links_free;
+	tlsf->links_free = link;
+	return block;
+}
+
+/* Link a free block into a list, see insert_free_block */
+// ASAN pre: unpoisoned metadata block
+static void link_insert(tlsf_t *tlsf, block_header_t *block, int fl, int sl)
+{
+	free_link_t *link = tlsf->links_free;
+	free_link_t *prev = &tlsf->link_null;
+	free_link_t *current = block_link(tlsf, list_head(tlsf, fl, sl));
+	int i;
+
+	tlsf_assert(link && "link table exhausted");
+	tlsf->links_free = link->next;
+
+	/* link_null ends all lists, so prev is tracked rather than read back */
+	if (tlsf->placement == TLSF_PLACE_ADDRESS) {
+		for (i = 0; i < PLACE_SCAN_MAX && current != &tlsf->link_null && current->block < block; i++) {
+			prev = current;
+			current = current->next;
+		}
+	}
+
+	link->block = block;
+	link->size = block_size(block);
+	link->next = current;
+	link->prev = prev;
+	prev->next = link;
+	current->prev = link;
+	if (prev == &tlsf->link_null) {
+		list_set_head(tlsf, fl, sl, block);
+	}
+
+	ASAN_UNPOISON_MEMORY_REGION(&block->free_list, sizeof(struct free_list));
+	block->free_list.next_free = tlsf_cast(block_header_t *, tlsf_cast(void *, link));
+	block->free_list.prev_free = NULL;
+	ASAN_POISON_MEMORY_REGION(&block->free_list, sizeof(struct free_list));
+}
+#endif
+
 /* Remove a free block from the free list */
 // ASAN pre: unpoisoned metadata block
 // ASAN temporarily unpoisons block/next/prev free list
 static void remove_free_block(tlsf_t *tlsf, block_header_t *block, int fl, int sl)
 {
-	ASAN_UNPOISON_MEMORY_REGION(&block->free_list, sizeof(struct free_list));
-	block_header_t *prev = block->free_list.prev_free;
-	block_header_t *next = block->free_list.next_free;
-	ASAN_POISON_MEMORY_REGION(&block->free_list, sizeof(struct free_list));
+	block_header_t *next;
+
+#if TLSF_OOB_LINKS
+	if (list_in_table(fl)) {
+		next = link_remove(tlsf, block);
+	} else
+#endif
+	{
+		ASAN_UNPOISON_MEMORY_REGION(&block->free_list, sizeof(struct free_list));
+		block_header_t *prev = block->free_list.prev_free;
+		next = block->free_list.next_free;
+		ASAN_POISON_MEMORY_REGION(&block->free_list, sizeof(struct free_list));
+
+		tlsf_assert(prev && "prev_free field can not be null");
+		tlsf_assert(next && "next_free field can not be null");
 
-	tlsf_assert(prev && "prev_free field can not be null");
-	tlsf_assert(next && "next_free field can not be null");
+		ASAN_UNPOISON_MEMORY_REGION(&next->free_list, sizeof(struct free_list));
+		ASAN_UNPOISON_MEMORY_REGION(&prev->free_list, sizeof(struct free_list));
 
-	ASAN_UNPOISON_MEMORY_REGION(&next->free_list, sizeof(struct free_list));
-	ASAN_UNPOISON_MEMORY_REGION(&prev->free_list, sizeof(struct free_list));
+		next->free_list.prev_free = prev;
+		prev->free_list.next_free = next;
 
-	next->free_list.prev_free = prev;
-	prev->free_list.next_free = next;
+		ASAN_POISON_MEMORY_REGION(&next->free_list, sizeof(struct free_list));
+		ASAN_POISON_MEMORY_REGION(&prev->free_list, sizeof(struct free_list));
+	}
 
-	ASAN_POISON_MEMORY_REGION(&next->free_list, sizeof(struct free_list));
-	ASAN_POISON_MEMORY_REGION(&prev->free_list, sizeof(struct free_list));
+	tlsf_stat_sub(tlsf, stats.free_bytes, block_size(block));
+	tlsf_stat_sub(tlsf, stats.free_blocks, 1);
+	tlsf_stat_sub(tlsf, census_blocks[fl][sl], 1);
+	tlsf_stat_sub(tlsf, census_bytes[fl][sl], block_size(block));
 
 	/* If this block is the head of the free list, set new head */
-	if (tlsf->blocks[fl][sl] == block) {
-		tlsf->blocks[fl][sl] = next;
+	if (list_head(tlsf, fl, sl) == block) {
+		list_set_head(tlsf, fl, sl, next);
 
 		/* If the new head is null, clear the bitmap */
 		if (next == &tlsf->block_null) {
-			tlsf->sl_bitmap[fl] &= ~(1U << sl);
+			tlsf->sl_bitmap[fl] &= ~(tlsf_cast(sl_bitmap_t, 1) << sl);
 
 			/* If the second bitmap is now empty, clear the fl bitmap */
 			if (tlsf->sl_bitmap[fl] == 0) {
-				tlsf->fl_bitmap &= ~(1U << fl);
+				tlsf->fl_bitmap &= ~(tlsf_cast(size_t, 1) << fl);
 			}
 		}
 	}
@@ -525,37 +1170,67 @@ static void remove_free_block(tlsf_t *tlsf, block_header_t *block, int fl, int s
 // ASAN temporarily unpoisons free list of current free list head
 static void insert_free_block(tlsf_t *tlsf, block_header_t *block, int fl, int sl)
 {
-	block_header_t *current = tlsf->blocks[fl][sl];
-	tlsf_assert(current && "free list cannot have a null entry");
+	tlsf_assert(list_head(tlsf, fl, sl) && "free list cannot have a null entry");
 	tlsf_assert(block && "cannot insert a null entry into the free list");
-
-	ASAN_UNPOISON_MEMORY_REGION(&current->free_list, sizeof(struct free_list));
-	ASAN_UNPOISON_MEMORY_REGION(&block->free_list, sizeof(struct free_list));
-	block->free_list.next_free = current;
-	block->free_list.prev_free = &tlsf->block_null;
-	current->free_list.prev_free = block;
-	ASAN_POISON_MEMORY_REGION(&current->free_list, sizeof(struct free_list));
-	ASAN_POISON_MEMORY_REGION(&block->free_list, sizeof(struct free_list));
-
 	tlsf_assert(block_to_ptr(block) == align_ptr(block_to_ptr(block), ALIGN_SIZE)
 		&& "block not aligned properly");
-	/*
-	 * Insert the new block at the head of the list, and mark the first-
-	 * and second-level bitmaps appropriately.
-	 */
-	tlsf->blocks[fl][sl] = block;
-	tlsf->fl_bitmap |= (1U << fl);
-	tlsf->sl_bitmap[fl] |= (1U << sl);
-}
-
-/* Remove a given block from the free list */
-// ASAN pre: unpoisoned metadata block
-static void block_remove(tlsf_t *tlsf, block_header_t *block)
-{
-	int fl, sl;
-	mapping_search(block_size(block), &fl, &sl);
-	remove_free_block(tlsf, block, fl, sl);
-}
+
+#if TLSF_OOB_LINKS
+	if (list_in_table(fl)) {
+		link_insert(tlsf, block, fl, sl);
+	} else
+#endif
+	{
+		block_header_t *prev = &tlsf->block_null;
+		block_header_t *current = list_head(tlsf, fl, sl);
+		int i;
+
+		/* Keep the lowest addresses at the head, with a bounded scan */
+		if (tlsf->placement == TLSF_PLACE_ADDRESS) {
+			for (i = 0; i < PLACE_SCAN_MAX && current != &tlsf->block_null && current < block; i++) {
+				prev = current;
+				current = block_next_free(current);
+			}
+		}
+
+		ASAN_UNPOISON_MEMORY_REGION(&current->free_list, sizeof(struct free_list));
+		ASAN_UNPOISON_MEMORY_REGION(&block->free_list, sizeof(struct free_list));
+		block->free_list.next_free = current;
+		block->free_list.prev_free = prev;
+		current->free_list.prev_free = block;
+		ASAN_POISON_MEMORY_REGION(&current->free_list, sizeof(struct free_list));
+		ASAN_POISON_MEMORY_REGION(&block->free_list, sizeof(struct free_list));
+
+		/*
+		 * Insert the new block at the head of the list, or after the blocks
+		 * below it, and mark the first- and second-level bitmaps
+		 * appropriately.
+		 */
+		if (prev != &tlsf->block_null) {
+			ASAN_UNPOISON_MEMORY_REGION(&prev->free_list, sizeof(struct free_list));
+			prev->free_list.next_free = block;
+			ASAN_POISON_MEMORY_REGION(&prev->free_list, sizeof(struct free_list));
+		} else {
+			list_set_head(tlsf, fl, sl, block);
+		}
+	}
+	tlsf->fl_bitmap |= (tlsf_cast(size_t, 1) << fl);
+	tlsf->sl_bitmap[fl] |= (tlsf_cast(sl_bitmap_t, 1) << sl);
+
+	tlsf_stat_add(tlsf, stats.free_bytes, block_size(block));
+	tlsf_stat_add(tlsf, stats.free_blocks, 1);
+	tlsf_stat_add(tlsf, census_blocks[fl][sl], 1);
+	tlsf_stat_add(tlsf, census_bytes[fl][sl], block_size(block));
+}
+
+/* Remove a given block from the free list */
+// ASAN pre: unpoisoned metadata block
+static void block_remove(tlsf_t *tlsf, block_header_t *block)
+{
+	int fl, sl;
+	mapping_search(block_size(block), &fl, &sl);
+	remove_free_block(tlsf, block, fl, sl);
+}
 
 /* Insert a given block into the free list */
 // ASAN pre: unpoisoned metadata block
@@ -592,7 +1267,9 @@ static block_header_t *block_split(block_header_t *block, size_t new_size)
 	tlsf_assert(remain_size >= block_size_min && "block split with invalid size");
 	block_set_size(remaining, remain_size);
 	// Less frequent to set this here instead of in block_prepare_used()
-	remaining->metadata.tlsf = block->metadata.tlsf;
+	block_inherit_heap(remaining, block);
+	/* The tail of a purged block is still purged, used blocks are never marked */
+	block_set_purged(remaining, block_is_purged(block));
 	block_mark_as_free(remaining);
 
 
@@ -605,8 +1282,9 @@ static block_header_t *block_split(block_header_t *block, size_t new_size)
 static void block_absorb(block_header_t *prev, block_header_t *block)
 {
 	tlsf_assert(!block_is_last(prev) && "previous block can't be last");
-	/* Note: Leaves flags untouched */
+	/* Note: Leaves flags untouched, except that the header in between is dirty */
 	prev->metadata.size += block_size(block) + metadata_size;
+	block_set_purged(prev, 0);
 	block_link_next(prev);
 }
 
@@ -652,7 +1330,8 @@ static void block_merge_next(tlsf_t *tlsf, block_header_t *block)
 static void block_trim_free(tlsf_t *tlsf, block_header_t *block, size_t size)
 {
 	tlsf_assert(block_is_free(block) && "block must be free");
-	if (block_can_split(block, size)) {
+	if (block_can_split(block, size)
+		&& block_size(block) - size - metadata_size >= tlsf->split_min) {
 		block_header_t *remaining_block = block_split(block, size);
 		block_link_next(block);
 		block_set_prev_free(remaining_block);
@@ -696,23 +1375,58 @@ static void block_trim_free_leading(tlsf_t *tlsf, block_header_t **block, size_t
 	}
 }
 
+/*
+ * Good fit: look at the first entries of the request's own class, which
+ * hold blocks both smaller and larger than the request.
+ */
 // ASAN post: unpoisoned metadata block
+static block_header_t *block_probe_class(tlsf_t *tlsf, size_t size, int fl, int sl)
+{
+	block_header_t *block = list_head(tlsf, fl, sl);
+	unsigned int i;
+
+#if TLSF_OOB_LINKS
+	/* The sizes are in the table, only the block taken is touched */
+	if (list_in_table(fl)) {
+		const free_link_t *link = block_link(tlsf, block);
+		for (i = 0; i < tlsf->fit_probe && link != &tlsf->link_null; i++, link = link->next) {
+			if (link->size >= size) {
+				ASAN_UNPOISON_MEMORY_REGION(&link->block->metadata, sizeof(struct metadata));
+				return link->block;
+			}
+		}
+		return NULL;
+	}
+#endif
+
+	for (i = 0; i < tlsf->fit_probe && block != &tlsf->block_null; i++) {
+		ASAN_UNPOISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+		if (block_size(block) >= size) {
+			return block;
+		}
+		ASAN_POISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+		block = block_next_free(block);
+	}
+	return NULL;
+}
+
 static block_header_t *block_locate_free(tlsf_t *tlsf, size_t size)
 {
 	int fl = 0;
 	int sl = 0;
 	block_header_t *block = NULL;
 
-	if (size > 0) {
-		size_t adjusted = size;
-
-		/* Round up to the next block size (for allocations) */
-		if (size >= SMALL_BLOCK_SIZE) {
-			const size_t round = (1 << (tlsf_fls_sizet(size) - SL_INDEX_COUNT_LOG2)) - 1;
-			adjusted += round;
+	if (size > 0 && tlsf->fit_probe > 0) {
+		mapping_search(size, &fl, &sl);
+		if (fl < FL_INDEX_COUNT && (block = block_probe_class(tlsf, size, fl, sl)) != NULL) {
+			remove_free_block(tlsf, block, fl, sl);
+			return block;
 		}
+	}
 
-		mapping_search(adjusted, &fl, &sl);
+	if (size > 0) {
+		/* Round up to the next block size (for allocations) */
+		mapping_search(mapping_round(size), &fl, &sl);
 
 		/*
 		 * The above can futz with the size, so for excessively large sizes it can sometimes wind up
@@ -740,7 +1454,7 @@ static void *block_prepare_used(tlsf_t *tlsf, block_header_t *block, size_t size
 		tlsf_assert(size && "size must be non-zero");
 		block_trim_free(tlsf, block, size);
 		block_mark_as_used(block);
-		assert(block->metadata.tlsf == tlsf);
+		assert(block_heap(block) == tlsf);
 		p = block_to_ptr(block);
 		ASAN_UNPOISON_MEMORY_REGION(p, block_size(block));
 		ASAN_POISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
@@ -748,497 +1462,3066 @@ static void *block_prepare_used(tlsf_t *tlsf, block_header_t *block, size_t size
 	return p;
 }
 
-/* Clear structure and point all empty lists at the null block */
-static void control_construct(tlsf_t *tlsf)
+/*
+ * Carve up to count used blocks of the given size off the front of a
+ * located free block, and trim the last one. Returns the number carved.
+ */
+// ASAN pre: unpoisoned metadata block
+static size_t block_carve(tlsf_t *tlsf, block_header_t *block, size_t size,
+	size_t count, void **ptrs)
 {
-	int i, j;
+	size_t carved = 0;
 
-	tlsf->block_null.free_list.next_free = &tlsf->block_null;
-	tlsf->block_null.free_list.prev_free = &tlsf->block_null;
+	/* Split off a block only while the remainder can hold another one */
+	while (carved + 1 < count && block_size(block) >= 2 * size + metadata_size) {
+		block_header_t *remaining = block_split(block, size);
+		block_mark_as_used(block);
+		ASAN_UNPOISON_MEMORY_REGION(&remaining->metadata, sizeof(struct metadata));
 
-	tlsf->fl_bitmap = 0;
-	for (i = 0; i < FL_INDEX_COUNT; i++) {
-		tlsf->sl_bitmap[i] = 0;
-		for (j = 0; j < SL_INDEX_COUNT; j++) {
-			tlsf->blocks[i][j] = &tlsf->block_null;
-		}
+		ptrs[carved] = block_to_ptr(block);
+		ASAN_UNPOISON_MEMORY_REGION(ptrs[carved], size);
+		ASAN_POISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+		carved++;
+		block = remaining;
 	}
 
-	ASAN_POISON_MEMORY_REGION(&tlsf->block_null.free_list, sizeof(struct free_list));
+	ptrs[carved++] = block_prepare_used(tlsf, block, size);
+	return carved;
+}
+
+/* Return a used block to the free lists, coalescing with its neighbors */
+// ASAN pre: unpoisoned metadata block
+// ASAN post: poisoned metadata block
+static void block_release(tlsf_t *tlsf, block_header_t *block)
+{
+	tlsf_assert(!block_is_free(block) && "block already marked as free");
+	block_mark_as_free(block);
+	block_set_purged(block, 0);
+	block_merge_prev(tlsf, &block);
+	block_merge_next(tlsf, block);
+	block_insert(tlsf, block);
+	ASAN_POISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
 }
 
 /*
- * Debugging utilities.
+ * Deferred coalescing.
+ *
+ * With quick lists enabled, blocks freed from the first QUICK_FL_COUNT
+ * first-level lists stay marked as used, and wait on a list per size
+ * class for the next request of their class, linked through their
+ * payload. A class is released, and its blocks coalesced, once it holds
+ * quick_max blocks; all of them are once the lists hold more than
+ * quick_bytes_max bytes, or when a request finds no free block.
  */
 
-typedef struct integrity {
-	int prev_status;
-	int status;
-} integrity_t;
+/* Quick list of a block size, or -1 */
+static int quick_class(const tlsf_t *tlsf, size_t size)
+{
+	int fl, sl;
 
-#define tlsf_insist(x) { tlsf_assert(x); if (!(x)) { status--; } }
+	if (tlsf->quick_max == 0 || size == 0) {
+		return -1;
+	}
+	mapping_search(size, &fl, &sl);
+	return fl < QUICK_FL_COUNT ? fl * SL_INDEX_COUNT + sl : -1;
+}
 
-static void integrity_walker(void *ptr, size_t size, int used, void *user)
+/* Next block on a quick list, which never goes through the link table */
+static block_header_t *quick_next(const block_header_t *block)
 {
-	block_header_t *block = block_from_ptr(ptr);
-	integrity_t *integ = tlsf_cast(integrity_t *, user);
-	const int this_prev_status = block_is_prev_free(block) ? 1 : 0;
-	const int this_status = block_is_free(block) ? 1 : 0;
-	const size_t this_block_size = block_size(block);
+	ASAN_UNPOISON_MEMORY_REGION(&block->free_list, sizeof(struct free_list));
+	block_header_t *next = block->free_list.next_free;
+	ASAN_POISON_MEMORY_REGION(&block->free_list, sizeof(struct free_list));
+	return next;
+}
 
-	int status = 0;
-	(void)used;
-	tlsf_insist(integ->prev_status == this_prev_status && "prev status incorrect");
-	tlsf_insist(size == this_block_size && "block size incorrect");
+static void quick_release(tlsf_t *tlsf, int cls)
+{
+	block_header_t *block = tlsf->quick[cls];
 
-	integ->prev_status = this_status;
-	integ->status += status;
+	while (block != NULL) {
+		block_header_t *next = quick_next(block);
+		ASAN_UNPOISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+		tlsf->quick_bytes -= block_size(block);
+		block_release(tlsf, block);
+		block = next;
+	}
+	tlsf->quick[cls] = NULL;
+	tlsf->quick_count[cls] = 0;
 }
 
-int tlsf_check(tlsf_t *tlsf)
+static void quick_release_all(tlsf_t *tlsf)
 {
-	int i, j;
-	int status = 0;
+	int cls;
 
-	/* Check that the free lists and bitmaps are accurate */
-	for (i = 0; i < FL_INDEX_COUNT; i++) {
-		for (j = 0; j < SL_INDEX_COUNT; j++) {
-			const int fl_map = tlsf->fl_bitmap & (1 << i);
-			const int sl_list = tlsf->sl_bitmap[i];
-			const int sl_map = sl_list & (1 << j);
-			const block_header_t *block = tlsf->blocks[i][j];
+	for (cls = 0; tlsf->quick_bytes != 0 && cls < QUICK_CLASS_COUNT; cls++) {
+		if (tlsf->quick[cls] != NULL) {
+			quick_release(tlsf, cls);
+		}
+	}
+}
 
-			/* Check that first- and second-level lists agree */
-			if (fl_map == 0) {
-				tlsf_insist(!sl_map && "second-level map must be null");
-			}
+/* Queue a used block on its quick list, if it has one */
+// ASAN pre: unpoisoned metadata block, poisoned data
+// ASAN post: poisoned metadata block if queued
+static int quick_push(tlsf_t *tlsf, block_header_t *block)
+{
+	const size_t size = block_size(block);
+	const int cls = quick_class(tlsf, size);
 
-			if (sl_map == 0) {
-				tlsf_insist(block == &tlsf->block_null && "block list must be null");
-				continue;
-			}
+	if (cls < 0) {
+		return 0;
+	}
+	if (tlsf->quick_count[cls] >= tlsf->quick_max) {
+		quick_release(tlsf, cls);
+	}
 
-			/* Check that there is at least one free block */
-			tlsf_insist(sl_list && "no free blocks in second-level map");
-			tlsf_insist(block != &tlsf->block_null && "block should not be null");
+	/* The user may have written to the block, it is handed out again as is */
+	block_set_purged(block, 0);
+	ASAN_UNPOISON_MEMORY_REGION(&block->free_list, sizeof(struct free_list));
+	block->free_list.next_free = tlsf->quick[cls];
+	ASAN_POISON_MEMORY_REGION(&block->free_list, sizeof(struct free_list));
+	ASAN_POISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+	tlsf->quick[cls] = block;
+	tlsf->quick_count[cls]++;
+	tlsf->quick_bytes += size;
 
-			while (block != &tlsf->block_null) {
-				int fli, sli;
-				tlsf_insist(block_is_free(block) && "block should be free");
-				tlsf_insist(!block_is_prev_free(block) && "blocks should have coalesced");
-				tlsf_insist(!block_is_free(block_next(block)) && "blocks should have coalesced");
-				tlsf_insist(block_is_prev_free(block_next(block)) && "block should be free");
-				tlsf_insist(block_size(block) >= block_size_min && "block not minimum size");
+	if (tlsf->quick_bytes_max != 0 && tlsf->quick_bytes > tlsf->quick_bytes_max) {
+		quick_release_all(tlsf);
+	}
+	return 1;
+}
 
-				mapping_search(block_size(block), &fli, &sli);
-				tlsf_insist(fli == i && sli == j && "block size indexed in wrong list");
-				block = block->free_list.next_free;
-			}
+/* Take a block of at least size bytes off its quick list */
+// ASAN post: unpoisoned metadata block
+static block_header_t *quick_pop(tlsf_t *tlsf, size_t size)
+{
+	const int cls = quick_class(tlsf, size);
+	block_header_t *block = cls < 0 ? NULL : tlsf->quick[cls];
+
+	if (block != NULL) {
+		ASAN_UNPOISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+		if (block_size(block) < size) {
+			ASAN_POISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+			return NULL;
 		}
+		tlsf->quick[cls] = quick_next(block);
+		tlsf->quick_count[cls]--;
+		tlsf->quick_bytes -= block_size(block);
 	}
-
-	return status;
+	return block;
 }
 
-#undef tlsf_insist
+/*
+ * Region registry.
+ *
+ * Pointers into ranges that carry no block headers cannot be resolved
+ * through block_from_ptr. Such ranges are registered here so that the
+ * pointer-only queries (tlsf_from_ptr, tlsf_block_size) can find their
+ * heap. With TLSF_COMPACT_HEADER block headers do not record their heap,
+ * and every pool is registered as well.
+ *
+ * The address space is cut into aligned granules of REGION_GRANULE bytes,
+ * and a three level radix index maps each granule to the heap whose
+ * ranges cover it, so a lookup is three loads whatever the number of
+ * ranges. Ranges of different heaps must therefore not share a granule;
+ * ranges of the same heap may, e.g. a slab arena inside a pool, and each
+ * granule counts them. The nodes of the index are mapped on first use
+ * and kept, as they only cover address space that held a pool.
+ * Registration is rare and takes a global lock; lookups are lock free
+ * and cost nothing while no range is registered.
+ */
 
-static void default_walker(void *ptr, size_t size, int used, void *user)
+typedef struct region_leaf {
+	_Atomic(tlsf_t *) heap[REGION_FANOUT];
+	/* Registered ranges over each granule, under region_lock */
+	unsigned int count[REGION_FANOUT];
+} region_leaf_t;
+
+typedef struct region_node {
+	_Atomic(region_leaf_t *) leaf[REGION_FANOUT];
+} region_node_t;
+
+static _Atomic(region_node_t *) region_root[REGION_FANOUT];
+static atomic_int region_count;
+static pthread_mutex_t region_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Granules beyond this address are not indexed */
+static const uint64_t region_reach =
+	tlsf_cast(uint64_t, 1) << (REGION_GRANULE_LOG2 + 3 * REGION_LEVEL_BITS);
+
+/* Zero filled memory for a node of the index */
+static void *region_node_alloc(size_t bytes)
 {
-	(void)user;
-	printf("\t%p %s size: %x (%p)\n", ptr, used ? "used" : "free", (unsigned int)size, block_from_ptr(ptr));
+#if HAVE_MMAP
+	void *mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return mem != MAP_FAILED ? mem : NULL;
+#else
+	return calloc(1, bytes);
+#endif
 }
 
-void tlsf_walk_pool(tlsf_pool_t *pool, tlsf_walker walker, void *user)
+/* Leaf of a granule, created if need be under region_lock */
+static region_leaf_t *region_leaf(uint64_t granule, int create)
 {
-	tlsf_walker pool_walker = walker ? walker : default_walker;
-	block_header_t *block = first_block(pool);
+	_Atomic(region_node_t *) *root = &region_root[granule >> (2 * REGION_LEVEL_BITS)];
+	region_node_t *node = atomic_load_explicit(root, memory_order_acquire);
 
-	while (block && !block_is_last(block)) {
-		pool_walker(
-			block_to_ptr(block),
-			block_size(block),
-			!block_is_free(block),
-			user);
-		block = block_next(block);
+	if (node == NULL) {
+		if (!create || (node = region_node_alloc(sizeof(region_node_t))) == NULL) {
+			return NULL;
+		}
+		atomic_store_explicit(root, node, memory_order_release);
 	}
-}
 
-size_t tlsf_block_size(void *ptr)
-{
-	size_t size = 0;
-	if (ptr != NULL) {
-		const block_header_t *block = block_from_ptr(ptr);
+	_Atomic(region_leaf_t *) *slot = &node->leaf[(granule >> REGION_LEVEL_BITS) & (REGION_FANOUT - 1)];
+	region_leaf_t *leaf = atomic_load_explicit(slot, memory_order_acquire);
 
-		ASAN_UNPOISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
-		size = block_size(block);
-		ASAN_POISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+	if (leaf == NULL) {
+		if (!create || (leaf = region_node_alloc(sizeof(region_leaf_t))) == NULL) {
+			return NULL;
+		}
+		atomic_store_explicit(slot, leaf, memory_order_release);
 	}
-	return size;
+	return leaf;
 }
 
-// Disable address sanitizer to allow retrieval of the heap without
-// races with threads accessing adjacent allocations.
-// This allows wrappers around TLSF to use per-heap locks:
-// They find which lock to use by calling this function
-// without the need to hold a global lock
-ASAN_NO_SANITIZE_ADDRESS
-tlsf_t *tlsf_from_ptr(void *ptr)
+static int region_register(tlsf_t *tlsf, const void *start, const void *end)
 {
-	const block_header_t *block = block_from_ptr(ptr);
-	tlsf_t *tlsf;
+	const uint64_t first = tlsf_cast(uint64_t, tlsf_cast(uintptr_t, start)) >> REGION_GRANULE_LOG2;
+	const uint64_t last = (tlsf_cast(uint64_t, tlsf_cast(uintptr_t, end)) - 1) >> REGION_GRANULE_LOG2;
+	uint64_t granule;
+	int status = 0;
 
-	tlsf = block->metadata.tlsf;
+	if (tlsf_cast(uint64_t, tlsf_cast(uintptr_t, end)) > region_reach) {
+		printf("tlsf: Regions must end below address %#llx.\n",
+			tlsf_cast(unsigned long long, region_reach));
+		return -1;
+	}
 
-	return tlsf;
+	pthread_mutex_lock(&region_lock);
+
+	/* Check all granules first, so that a failure leaves nothing behind */
+	for (granule = first; status == 0 && granule <= last; granule++) {
+		region_leaf_t *leaf = region_leaf(granule, 1);
+		const int i = tlsf_cast(int, granule & (REGION_FANOUT - 1));
+
+		if (leaf == NULL) {
+			printf("tlsf: Out of memory for the region index.\n");
+			status = -1;
+		} else if (leaf->count[i] != 0
+			&& atomic_load_explicit(&leaf->heap[i], memory_order_relaxed) != tlsf) {
+			printf("tlsf: Regions of different heaps must not share a %u byte granule.\n",
+				(unsigned int)REGION_GRANULE);
+			status = -1;
+		}
+	}
+
+	for (granule = first; status == 0 && granule <= last; granule++) {
+		region_leaf_t *leaf = region_leaf(granule, 0);
+		const int i = tlsf_cast(int, granule & (REGION_FANOUT - 1));
+
+		if (leaf->count[i]++ == 0) {
+			atomic_store_explicit(&leaf->heap[i], tlsf, memory_order_release);
+		}
+	}
+	if (status == 0) {
+		atomic_fetch_add_explicit(&region_count, 1, memory_order_release);
+	}
+
+	pthread_mutex_unlock(&region_lock);
+	return status;
 }
 
-int tlsf_check_pool(tlsf_pool_t *pool)
+static void region_unregister(const void *start, const void *end)
 {
-	/* Check that the blocks are physically correct */
-	integrity_t integ = { 0, 0 };
-	tlsf_walk_pool(pool, integrity_walker, &integ);
+	const uint64_t first = tlsf_cast(uint64_t, tlsf_cast(uintptr_t, start)) >> REGION_GRANULE_LOG2;
+	const uint64_t last = (tlsf_cast(uint64_t, tlsf_cast(uintptr_t, end)) - 1) >> REGION_GRANULE_LOG2;
+	uint64_t granule;
+
+	pthread_mutex_lock(&region_lock);
+	for (granule = first; granule <= last; granule++) {
+		region_leaf_t *leaf = region_leaf(granule, 0);
+		const int i = tlsf_cast(int, granule & (REGION_FANOUT - 1));
+
+		tlsf_assert(leaf && leaf->count[i] && "region was not registered");
+		if (--leaf->count[i] == 0) {
+			atomic_store_explicit(&leaf->heap[i], NULL, memory_order_release);
+		}
+	}
+	atomic_fetch_sub_explicit(&region_count, 1, memory_order_release);
+	pthread_mutex_unlock(&region_lock);
+}
 
-	return integ.status;
+static tlsf_t *region_lookup(const void *ptr)
+{
+	const uint64_t addr = tlsf_cast(uint64_t, tlsf_cast(uintptr_t, ptr));
+	region_leaf_t *leaf;
+
+	if (atomic_load_explicit(&region_count, memory_order_acquire) == 0 || addr >= region_reach) {
+		return NULL;
+	}
+
+	leaf = region_leaf(addr >> REGION_GRANULE_LOG2, 0);
+	if (leaf == NULL) {
+		return NULL;
+	}
+	return atomic_load_explicit(&leaf->heap[(addr >> REGION_GRANULE_LOG2) & (REGION_FANOUT - 1)],
+		memory_order_acquire);
 }
 
 /*
- * Size of the TLSF structures in a given memory block passed to
- * tlsf_create, equal to the size of a tlsf_t
+ * Slabs.
+ *
+ * With a slab arena enabled, allocations below SMALL_BLOCK_SIZE are
+ * served from slab pages carved out of one TLSF block, one size class
+ * per page: the classes are the second-level lists of the first
+ * first-level list, i.e. multiples of ALIGN_SIZE. Each class keeps a
+ * list of partially used slabs; the pages of empty slabs go back to the
+ * arena, except for the last partial slab of a class.
  */
-size_t tlsf_size(void)
+
+static int slab_owns(const tlsf_t *tlsf, const void *ptr)
 {
-	return sizeof(tlsf_t);
+	const char *p = tlsf_cast(const char *, ptr);
+	return p >= tlsf->slab_start && p < tlsf->slab_end;
 }
 
-size_t tlsf_align_size(void)
+/*
+ * Classes are the multiples of ALIGN_SIZE below SMALL_BLOCK_SIZE. Larger
+ * sizes below SMALL_BLOCK_SIZE would round up to class SL_INDEX_COUNT,
+ * which has no partial list.
+ */
+static int slab_fits(const tlsf_t *tlsf, size_t size)
 {
-	return ALIGN_SIZE;
+	return tlsf->slab_start != NULL && size > 0 && size <= SMALL_BLOCK_SIZE - ALIGN_SIZE;
 }
 
-size_t tlsf_block_size_min(void)
+tlsf_static_assert((SMALL_BLOCK_SIZE - ALIGN_SIZE) / ALIGN_SIZE < SL_INDEX_COUNT);
+
+static int slab_class(size_t size)
 {
-	return block_size_min;
+	const int cls = tlsf_cast(int, align_up(size, ALIGN_SIZE) / ALIGN_SIZE);
+	tlsf_assert(cls > 0 && cls < SL_INDEX_COUNT && "size has no slab class");
+	return cls;
 }
 
-size_t tlsf_block_size_max(void)
+static slab_t *slab_from_ptr(const void *ptr)
 {
-	return block_size_max;
+	return tlsf_cast(slab_t *, tlsf_cast(uintptr_t, ptr) & ~(tlsf_cast(uintptr_t, SLAB_PAGE_SIZE) - 1));
 }
 
-/*
- * Overhead of the TLSF structures in a given memory block passed to
- * tlsf_add_pool, equal to the overhead of a free block and the
- * sentinel block.
- */
-size_t tlsf_pool_overhead(void)
+static size_t slab_offset(void)
 {
-	return 2 * metadata_size;
+	return align_up(sizeof(slab_t), ALIGN_SIZE);
 }
 
-size_t tlsf_alloc_overhead(void)
+static void slab_link(slab_t **head, slab_t *slab)
 {
-	return metadata_size;
+	slab->prev = NULL;
+	slab->next = *head;
+	if (*head != NULL) {
+		(*head)->prev = slab;
+	}
+	*head = slab;
 }
 
-tlsf_pool_t *tlsf_add_pool(tlsf_t *tlsf, void *mem, size_t bytes)
+static void slab_unlink(slab_t **head, slab_t *slab)
 {
-	block_header_t *block;
-	block_header_t *next;
-
-	const size_t pool_overhead = tlsf_pool_overhead();
-	const size_t pool_bytes = align_down(bytes - pool_overhead, ALIGN_SIZE);
+	if (slab->prev != NULL) {
+		slab->prev->next = slab->next;
+	} else {
+		*head = slab->next;
+	}
+	if (slab->next != NULL) {
+		slab->next->prev = slab->prev;
+	}
+}
 
-	if (((ptrdiff_t)mem % ALIGN_SIZE) != 0) {
-		printf("tlsf_add_pool: Memory must be aligned by %u bytes.\n",
-			(unsigned int)ALIGN_SIZE);
+/* Start a new slab for a class, from a free page or the untouched arena */
+static slab_t *slab_create(tlsf_t *tlsf, int cls)
+{
+	slab_t *slab = tlsf->slab_pages;
+	unsigned int i;
+
+	if (slab != NULL) {
+		tlsf->slab_pages = slab->next;
+	} else if (tlsf->slab_end - tlsf->slab_bump >= SLAB_PAGE_SIZE) {
+		slab = tlsf_cast(slab_t *, tlsf->slab_bump);
+		tlsf->slab_bump += SLAB_PAGE_SIZE;
+	} else {
 		return NULL;
 	}
 
-	if (pool_bytes < block_size_min || pool_bytes > block_size_max) {
-		printf("tlsf_add_pool: Memory size must be between %zu and %zu bytes.\n",
-			pool_overhead + block_size_min,
+	slab->size = tlsf_cast(unsigned int, cls) * ALIGN_SIZE;
+	slab->count = tlsf_cast(unsigned int, (SLAB_PAGE_SIZE - slab_offset()) / slab->size);
+	slab->free = slab->count;
+	for (i = 0; i < SLAB_MAP_WORDS; i++) {
+		const unsigned int first = i * 32;
+		if (first + 32 <= slab->count) {
+			slab->map[i] = ~0U;
+		} else if (first < slab->count) {
+			slab->map[i] = (1U << (slab->count - first)) - 1;
+		} else {
+			slab->map[i] = 0;
+		}
+	}
+	ASAN_POISON_MEMORY_REGION(tlsf_cast(char *, slab) + slab_offset(), SLAB_PAGE_SIZE - slab_offset());
+
+	slab_link(&tlsf->slab_partial[cls], slab);
+	return slab;
+}
+
+static void *slab_malloc(tlsf_t *tlsf, size_t size)
+{
+	const int cls = slab_class(size);
+	slab_t *slab = tlsf->slab_partial[cls];
+	unsigned int i = 0;
+
+	if (slab == NULL && (slab = slab_create(tlsf, cls)) == NULL) {
+		return NULL;
+	}
+
+	while (slab->map[i] == 0) {
+		i++;
+	}
+	const int bit = tlsf_ffs(slab->map[i]);
+	slab->map[i] &= ~(1U << bit);
+
+	/* Full slabs leave the partial list until an object is freed */
+	if (--slab->free == 0) {
+		slab_unlink(&tlsf->slab_partial[cls], slab);
+	}
+
+	void *p = tlsf_cast(char *, slab) + slab_offset() + (i * 32 + bit) * slab->size;
+	ASAN_UNPOISON_MEMORY_REGION(p, slab->size);
+	return p;
+}
+
+static void slab_free(tlsf_t *tlsf, void *ptr)
+{
+	slab_t *slab = slab_from_ptr(ptr);
+	const int cls = tlsf_cast(int, slab->size / ALIGN_SIZE);
+	const unsigned int index = tlsf_cast(unsigned int,
+		(tlsf_cast(char *, ptr) - tlsf_cast(char *, slab) - slab_offset()) / slab->size);
+
+	tlsf_assert(!(slab->map[index / 32] & (1U << (index % 32))) && "object already marked as free");
+	ASAN_POISON_MEMORY_REGION(ptr, slab->size);
+	slab->map[index / 32] |= 1U << (index % 32);
+
+	if (slab->free++ == 0) {
+		slab_link(&tlsf->slab_partial[cls], slab);
+	} else if (slab->free == slab->count
+		&& (slab->prev != NULL || slab->next != NULL)) {
+		/* Keep the last partial slab of a class to avoid thrashing */
+		slab_unlink(&tlsf->slab_partial[cls], slab);
+		slab->next = tlsf->slab_pages;
+		tlsf->slab_pages = slab;
+	}
+}
+
+/*
+ * Huge allocations.
+ *
+ * Requests from the huge threshold up get an anonymous mapping of their
+ * own, laid out as huge_header_t describes, instead of a block carved
+ * from a pool. Freeing one returns all of its pages at once, and realloc
+ * lets the kernel move its pages with mremap rather than copying them.
+ */
+
+static int huge_fits(const tlsf_t *tlsf, size_t size)
+{
+	return tlsf->huge_threshold != 0 && size >= tlsf->huge_threshold
+		&& size <= block_size_max;
+}
+
+#if HAVE_MMAP
+/* Mapping size for size bytes at the given alignment */
+static size_t huge_mapping_size(size_t align, size_t size)
+{
+	return align_up(sizeof(huge_header_t) + block_start_offset
+		+ tlsf_max(align, ALIGN_SIZE) + size, GROW_GRANULE);
+}
+
+/* Set up the headers of a huge block at ptr, in the mapping at map */
+static void huge_prepare(tlsf_t *tlsf, char *map, size_t bytes, void *ptr)
+{
+	block_header_t *block = block_from_ptr(ptr);
+	huge_header_t *huge = block_huge(block);
+
+	huge->map = map;
+	huge->bytes = bytes;
+	huge->tlsf = tlsf;
+	block->prev_trailer.prev_phys_block = NULL;
+	block->metadata.size = align_down(tlsf_cast(size_t, map + bytes - tlsf_cast(char *, ptr)),
+		ALIGN_SIZE) | block_header_prev_free_bit;
+	block_set_heap(block, tlsf);
+}
+#endif
+
+static void *huge_malloc(tlsf_t *tlsf, size_t align, size_t size)
+{
+	void *p = NULL;
+#if HAVE_MMAP
+	const size_t bytes = huge_mapping_size(align, size);
+	char *map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (map != MAP_FAILED) {
+		p = align_ptr(map + sizeof(huge_header_t) + block_start_offset, tlsf_max(align, ALIGN_SIZE));
+		huge_prepare(tlsf, map, bytes, p);
+	}
+#else
+	(void)tlsf;
+	(void)align;
+	(void)size;
+#endif
+	return p;
+}
+
+static void huge_free(block_header_t *block)
+{
+#if HAVE_MMAP
+	const huge_header_t *huge = block_huge(block);
+	munmap(huge->map, huge->bytes);
+#else
+	(void)block;
+#endif
+}
+
+/*
+ * Resize a huge block. The offset of the block in its mapping is kept, so
+ * the alignment of a huge tlsf_memalign block is only kept up to the page
+ * size, as with a moving realloc.
+ */
+static void *huge_realloc(tlsf_t *tlsf, void *ptr, size_t size)
+{
+	block_header_t *block = block_from_ptr(ptr);
+	const huge_header_t *huge = block_huge(block);
+	const size_t offset = tlsf_cast(size_t, tlsf_cast(char *, ptr) - tlsf_cast(char *, huge->map));
+	const size_t bytes = align_up(offset + size, GROW_GRANULE);
+	void *p = NULL;
+
+	if (size > block_size_max) {
+		return NULL;
+	}
+	if (bytes == huge->bytes) {
+		return ptr;
+	}
+#if HAVE_MREMAP && defined (MREMAP_MAYMOVE)
+	char *map = mremap(huge->map, huge->bytes, bytes, MREMAP_MAYMOVE);
+	if (map != MAP_FAILED) {
+		p = map + offset;
+		huge_prepare(tlsf, map, bytes, p);
+	}
+#else
+	p = huge_malloc(tlsf, ALIGN_SIZE, size);
+	if (p != NULL) {
+		memcpy(p, ptr, tlsf_min(block_size(block), size));
+		huge_free(block);
+	}
+#endif
+	return p;
+}
+
+/*
+ * Remote frees.
+ *
+ * A block freed by a thread that does not own its heap is pushed onto
+ * the heap's remote free list with a single compare-and-swap, linked
+ * through the first word of its (still unpoisoned) payload. The owner
+ * takes the whole list with one exchange on its next malloc or free and
+ * releases the blocks in a batch. Taking the whole list at once keeps
+ * the single consumer free of ABA problems.
+ */
+
+static void remote_push(tlsf_t *tlsf, block_header_t *block)
+{
+	block_header_t *head = atomic_load_explicit(&tlsf->remote_free, memory_order_relaxed);
+	do {
+		block->free_list.next_free = head;
+	} while (!atomic_compare_exchange_weak_explicit(&tlsf->remote_free, &head, block,
+		memory_order_release, memory_order_relaxed));
+}
+
+static void remote_drain(tlsf_t *tlsf)
+{
+	block_header_t *block;
+
+	/* Cheap check on every entry, the exchange only when there is work */
+	if (atomic_load_explicit(&tlsf->remote_free, memory_order_relaxed) == NULL) {
+		return;
+	}
+
+	block = atomic_exchange_explicit(&tlsf->remote_free, NULL, memory_order_acquire);
+	while (block != NULL) {
+		block_header_t *next = block->free_list.next_free;
+		tlsf_stat_add(tlsf, stats.free_count, 1);
+		if (slab_owns(tlsf, block_to_ptr(block))) {
+			slab_free(tlsf, block_to_ptr(block));
+			block = next;
+			continue;
+		}
+		if (block_is_huge(block)) {
+			huge_free(block);
+			block = next;
+			continue;
+		}
+		ASAN_UNPOISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+		ASAN_POISON_MEMORY_REGION(block_to_ptr(block), block_size(block));
+		block_release(tlsf, block);
+		block = next;
+	}
+}
+
+/* Clear structure and point all empty lists at the null block */
+static void control_construct(tlsf_t *tlsf)
+{
+	int i;
+
+	tlsf->block_null.free_list.next_free = &tlsf->block_null;
+	tlsf->block_null.free_list.prev_free = &tlsf->block_null;
+
+#if TLSF_OOB_LINKS
+	tlsf->link_null.next = tlsf->link_null.prev = &tlsf->link_null;
+	tlsf->link_null.block = &tlsf->block_null;
+	tlsf->link_null.size = 0;
+	tlsf->links_free = NULL;
+#endif
+
+	/* The list heads are left alone, see list_head */
+	tlsf->fl_bitmap = 0;
+	for (i = 0; i < FL_INDEX_COUNT; i++) {
+		tlsf->sl_bitmap[i] = 0;
+	}
+
+	atomic_init(&tlsf->remote_free, NULL);
+	tlsf->locked = 0;
+
+#if TLSF_STATISTIC
+	memset(&tlsf->stats, 0, sizeof(tlsf->stats));
+	memset(tlsf->census_blocks, 0, sizeof(tlsf->census_blocks));
+	memset(tlsf->census_bytes, 0, sizeof(tlsf->census_bytes));
+#endif
+
+	tlsf->slab_start = tlsf->slab_end = tlsf->slab_bump = NULL;
+	tlsf->slab_pages = NULL;
+	for (i = 0; i < SL_INDEX_COUNT; i++) {
+		tlsf->slab_partial[i] = NULL;
+	}
+
+	tlsf->pools = NULL;
+	tlsf->pool_bytes = 0;
+
+	tlsf->map = NULL;
+	tlsf->unmap = NULL;
+	tlsf->map_user = NULL;
+	tlsf->grow_next = GROW_SIZE_DEFAULT;
+	tlsf->grow_max = 0;
+	tlsf->grow_factor = 2;
+
+	tlsf->fit_probe = 0;
+	tlsf->split_min = 0;
+	tlsf->placement = TLSF_PLACE_LIFO;
+	tlsf->huge_threshold = 0;
+
+	for (i = 0; i < QUICK_CLASS_COUNT; i++) {
+		tlsf->quick[i] = NULL;
+		tlsf->quick_count[i] = 0;
+	}
+	tlsf->quick_max = 0;
+	tlsf->quick_bytes = 0;
+	tlsf->quick_bytes_max = 0;
+
+	ASAN_POISON_MEMORY_REGION(&tlsf->block_null.free_list, sizeof(struct free_list));
+}
+
+/*
+ * Heap locking.
+ *
+ * Heaps created with tlsf_create_locked serialize their public entry
+ * points on the lock from target.h. A contended acquisition first spins
+ * on trylock, then blocks (a futex wait for the default pthread mutex).
+ * The spin budget adapts to how long recent contended acquisitions took
+ * to succeed, so a lock held for short sections is spun on and a lock
+ * held for long ones is slept on. The counters are only written while
+ * holding the lock; the spin estimate is a hint and is read without it.
+ */
+
+static unsigned long long tlsf_cycles(void)
+{
+#if HAVE___BUILTIN_IA32_RDTSC
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return tlsf_cast(unsigned long long, ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static void tlsf_cpu_relax(void)
+{
+#if defined (__x86_64__) || defined (__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+static void heap_lock(tlsf_t *tlsf)
+{
+	if (!tlsf->locked) {
+		return;
+	}
+
+	if (!TLSF_TRY_ACQUIRE_LOCK(&tlsf->lock)) {
+		const unsigned long long start = tlsf_cycles();
+		const int estimate = atomic_load_explicit(&tlsf->spin_limit, memory_order_relaxed);
+		const int limit = tlsf_min(estimate * 2 + 10, LOCK_SPIN_MAX);
+		int spins = 0;
+		int acquired = 0;
+
+		while (spins < limit) {
+			spins++;
+			tlsf_cpu_relax();
+			if (TLSF_TRY_ACQUIRE_LOCK(&tlsf->lock)) {
+				acquired = 1;
+				break;
+			}
+		}
+		const unsigned long long spun = tlsf_cycles() - start;
+
+		if (!acquired) {
+			TLSF_ACQUIRE_LOCK(&tlsf->lock);
+		}
+
+		/* Spinning in vain halves the budget, so long sections are slept on */
+		atomic_store_explicit(&tlsf->spin_limit,
+			acquired ? estimate + (spins - estimate) / 8 : estimate / 2,
+			memory_order_relaxed);
+		tlsf->lock_stats.contended++;
+		tlsf->lock_stats.spin_cycles += spun;
+	}
+	tlsf->lock_stats.acquisitions++;
+}
+
+static void heap_unlock(tlsf_t *tlsf)
+{
+#if TLSF_STATISTIC
+	/* Peak usage is sampled whenever the heap is left */
+	const size_t used = tlsf->pool_bytes - tlsf->stats.free_bytes;
+	if (used > tlsf->stats.peak_used_bytes) {
+		tlsf->stats.peak_used_bytes = used;
+	}
+#endif
+	if (tlsf->locked) {
+		TLSF_RELEASE_LOCK(&tlsf->lock);
+	}
+}
+
+/*
+ * Debugging utilities.
+ */
+
+typedef struct integrity {
+	int prev_status;
+	int status;
+} integrity_t;
+
+#define tlsf_insist(x) { tlsf_assert(x); if (!(x)) { status--; } }
+
+static void integrity_walker(void *ptr, size_t size, int used, void *user)
+{
+	block_header_t *block = block_from_ptr(ptr);
+	integrity_t *integ = tlsf_cast(integrity_t *, user);
+	const int this_prev_status = block_is_prev_free(block) ? 1 : 0;
+	const int this_status = block_is_free(block) ? 1 : 0;
+	const size_t this_block_size = block_size(block);
+
+	int status = 0;
+	(void)used;
+	tlsf_insist(integ->prev_status == this_prev_status && "prev status incorrect");
+	tlsf_insist(size == this_block_size && "block size incorrect");
+
+	integ->prev_status = this_status;
+	integ->status += status;
+}
+
+int tlsf_check(tlsf_t *tlsf)
+{
+	int i, j;
+	int status = 0;
+
+	heap_lock(tlsf);
+
+	/* Check that the free lists and bitmaps are accurate */
+	for (i = 0; i < FL_INDEX_COUNT; i++) {
+		for (j = 0; j < SL_INDEX_COUNT; j++) {
+			const size_t fl_map = tlsf->fl_bitmap & (tlsf_cast(size_t, 1) << i);
+			const sl_bitmap_t sl_list = tlsf->sl_bitmap[i];
+			const sl_bitmap_t sl_map = sl_list & (tlsf_cast(sl_bitmap_t, 1) << j);
+			const block_header_t *block = list_head(tlsf, i, j);
+
+			/* Check that first- and second-level lists agree */
+			if (fl_map == 0) {
+				tlsf_insist(!sl_map && "second-level map must be null");
+			}
+
+			if (sl_map == 0) {
+				tlsf_insist(block == &tlsf->block_null && "block list must be null");
+				continue;
+			}
+
+			/* Check that there is at least one free block */
+			tlsf_insist(sl_list && "no free blocks in second-level map");
+			tlsf_insist(block != &tlsf->block_null && "block should not be null");
+
+			while (block != &tlsf->block_null) {
+				int fli, sli;
+				tlsf_insist(block_is_free(block) && "block should be free");
+				tlsf_insist(!block_is_prev_free(block) && "blocks should have coalesced");
+				tlsf_insist(!block_is_free(block_next(block)) && "blocks should have coalesced");
+				tlsf_insist(block_is_prev_free(block_next(block)) && "block should be free");
+				tlsf_insist(block_size(block) >= block_size_min && "block not minimum size");
+
+				mapping_search(block_size(block), &fli, &sli);
+				tlsf_insist(fli == i && sli == j && "block size indexed in wrong list");
+				block = block_next_free(block);
+			}
+		}
+	}
+
+	heap_unlock(tlsf);
+	return status;
+}
+
+#undef tlsf_insist
+
+static void default_walker(void *ptr, size_t size, int used, void *user)
+{
+	(void)user;
+	printf("\t%p %s size: %x (%p)\n", ptr, used ? "used" : "free", (unsigned int)size, block_from_ptr(ptr));
+}
+
+void tlsf_walk_pool(tlsf_pool_t *pool, tlsf_walker walker, void *user)
+{
+	tlsf_walker pool_walker = walker ? walker : default_walker;
+	block_header_t *block = first_block(pool);
+
+	while (block && !block_is_last(block)) {
+		pool_walker(
+			block_to_ptr(block),
+			block_size(block),
+			!block_is_free(block),
+			user);
+		block = block_next(block);
+	}
+}
+
+// Address sanitizer is disabled as in tlsf_from_ptr: the owner may be
+// updating the flag bits of this header while the size is read.
+ASAN_NO_SANITIZE_ADDRESS
+size_t tlsf_block_size(void *ptr)
+{
+	size_t size = 0;
+	tlsf_t *region = ptr != NULL ? region_lookup(ptr) : NULL;
+
+	if (region != NULL && slab_owns(region, ptr)) {
+		size = slab_from_ptr(ptr)->size;
+	} else if (ptr != NULL) {
+		const block_header_t *block = block_from_ptr(ptr);
+		size = block->metadata.size & ~(block_header_free_bit | block_header_prev_free_bit
+			| block_header_purged_bit);
+	}
+	return size;
+}
+
+// Disable address sanitizer to allow retrieval of the heap without
+// races with threads accessing adjacent allocations.
+// This allows wrappers around TLSF to use per-heap locks:
+// They find which lock to use by calling this function
+// without the need to hold a global lock
+ASAN_NO_SANITIZE_ADDRESS
+tlsf_t *tlsf_from_ptr(void *ptr)
+{
+	const block_header_t *block = block_from_ptr(ptr);
+	tlsf_t *tlsf = region_lookup(ptr);
+
+	if (tlsf == NULL) {
+		tlsf = block_heap(block);
+	}
+
+	return tlsf;
+}
+
+int tlsf_check_pool(tlsf_pool_t *pool)
+{
+	/* Check that the blocks are physically correct */
+	integrity_t integ = { 0, 0 };
+	tlsf_walk_pool(pool, integrity_walker, &integ);
+
+	return integ.status;
+}
+
+/*
+ * Free list census.
+ *
+ * A free list only holds blocks of at least the lower bound of its size
+ * class, so the class of the highest set bits gives the largest request
+ * that is known to succeed without looking at any block. The census
+ * comes from the per-list counters when TLSF_STATISTIC is set, and from
+ * walking the free lists otherwise.
+ */
+
+/* Find the highest non-empty free list, returns zero if there is none */
+static int census_top(const tlsf_t *tlsf, int *fli, int *sli)
+{
+	if (tlsf->fl_bitmap == 0) {
+		return 0;
+	}
+	*fli = tlsf_fls_sizet(tlsf->fl_bitmap);
+	*sli = tlsf_fls_sizet(tlsf->sl_bitmap[*fli]);
+	return 1;
+}
+
+static size_t largest_allocatable(const tlsf_t *tlsf)
+{
+	int fl, sl;
+	return census_top(tlsf, &fl, &sl) ? mapping_size(fl, sl) : 0;
+}
+
+size_t tlsf_census_size(void)
+{
+	return FL_INDEX_COUNT * SL_INDEX_COUNT;
+}
+
+size_t tlsf_largest_allocatable(tlsf_t *tlsf)
+{
+	heap_lock(tlsf);
+	const size_t largest = largest_allocatable(tlsf);
+	heap_unlock(tlsf);
+	return largest;
+}
+
+void tlsf_census(tlsf_t *tlsf, tlsf_bucket_t *buckets, tlsf_census_t *census)
+{
+	int fl, sl;
+
+	memset(census, 0, sizeof(*census));
+
+	heap_lock(tlsf);
+	for (fl = 0; fl < FL_INDEX_COUNT; fl++) {
+		for (sl = 0; sl < SL_INDEX_COUNT; sl++) {
+			size_t blocks = 0;
+			size_t bytes = 0;
+
+#if TLSF_STATISTIC
+			blocks = tlsf->census_blocks[fl][sl];
+			bytes = tlsf->census_bytes[fl][sl];
+#else
+			block_header_t *block = list_head(tlsf, fl, sl);
+			for (; block != &tlsf->block_null; block = block_next_free(block)) {
+				ASAN_UNPOISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+				blocks++;
+				bytes += block_size(block);
+				ASAN_POISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+			}
+#endif
+
+			if (buckets != NULL) {
+				tlsf_bucket_t *bucket = &buckets[fl * SL_INDEX_COUNT + sl];
+				bucket->size = mapping_size(fl, sl);
+				bucket->blocks = blocks;
+				bucket->bytes = bytes;
+			}
+			census->free_blocks += blocks;
+			census->free_bytes += bytes;
+		}
+	}
+
+	/* The largest block is on the highest list */
+	if (census_top(tlsf, &fl, &sl)) {
+		block_header_t *block = list_head(tlsf, fl, sl);
+		for (; block != &tlsf->block_null; block = block_next_free(block)) {
+			ASAN_UNPOISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+			census->largest_block = tlsf_max(census->largest_block, block_size(block));
+			ASAN_POISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+		}
+		census->largest_allocatable = mapping_size(fl, sl);
+	}
+	heap_unlock(tlsf);
+
+	if (census->free_bytes > 0) {
+		census->fragmentation = 1.0 - tlsf_cast(double, census->largest_block)
+			/ tlsf_cast(double, census->free_bytes);
+	}
+}
+
+/*
+ * Size of the TLSF structures in a given memory block passed to
+ * tlsf_create, equal to the size of a tlsf_t, which is padded to a
+ * multiple of ALIGN_SIZE
+ */
+size_t tlsf_size(void)
+{
+	return sizeof(tlsf_t);
+}
+
+size_t tlsf_align_size(void)
+{
+	return ALIGN_SIZE;
+}
+
+size_t tlsf_block_size_min(void)
+{
+	return block_size_min;
+}
+
+size_t tlsf_block_size_max(void)
+{
+	return block_size_max;
+}
+
+/*
+ * Overhead of the TLSF structures in a given memory block passed to
+ * tlsf_add_pool, equal to the overhead of the pool header, a free block
+ * and the sentinel block.
+ */
+size_t tlsf_pool_overhead(void)
+{
+	return sizeof(pool_header_t) + 2 * metadata_size;
+}
+
+size_t tlsf_alloc_overhead(void)
+{
+	return metadata_size;
+}
+
+const tlsf_variant_t *tlsf_get_variant(void)
+{
+	static const tlsf_variant_t variant = {
+		.name = TLSF_VARIANT_NAME,
+		.sl_index_count_log2 = SL_INDEX_COUNT_LOG2,
+		.fl_index_max = FL_INDEX_MAX,
+		.align_size = ALIGN_SIZE,
+		.create_with_pool = tlsf_create_with_pool,
+		.destroy = tlsf_destroy,
+		.malloc = tlsf_malloc,
+		.memalign = tlsf_memalign,
+		.realloc = tlsf_realloc,
+		.free = tlsf_free,
+		.block_size = tlsf_block_size,
+		.census = tlsf_census,
+		.size = tlsf_size,
+	};
+	return &variant;
+}
+
+/*
+ * Link tables. With TLSF_OOB_LINKS, each pool ends with a table of
+ * free_link_t entries, one per LINK_GRANULE bytes of the pool. The
+ * entries are shared by the heap: a block may be linked through the
+ * table of another pool, so the entries in use in a pool that goes away
+ * are moved to the tables of the other pools, which have room for all
+ * of their own large blocks.
+ */
+
+/* Offset of the link table of a pool of the given size */
+static size_t link_table_offset(size_t bytes)
+{
+#if TLSF_OOB_LINKS
+	return align_down(bytes - (bytes >> LINK_GRANULE_LOG2) * sizeof(free_link_t), ALIGN_SIZE);
+#else
+	return align_down(bytes, ALIGN_SIZE);
+#endif
+}
+
+/* Pool size that leaves the given number of bytes before the link table */
+static size_t link_pool_size(size_t bytes)
+{
+#if TLSF_OOB_LINKS
+	return bytes + bytes / (LINK_GRANULE / sizeof(free_link_t) - 1) + ALIGN_SIZE;
+#else
+	return bytes;
+#endif
+}
+
+static void link_table_add(tlsf_t *tlsf, void *mem, size_t bytes)
+{
+#if TLSF_OOB_LINKS
+	free_link_t *table = tlsf_cast(free_link_t *, tlsf_cast(char *, mem) + link_table_offset(bytes));
+	size_t i;
+
+	for (i = 0; i < bytes >> LINK_GRANULE_LOG2; i++) {
+		table[i].block = NULL;
+		table[i].next = tlsf->links_free;
+		tlsf->links_free = &table[i];
+	}
+#else
+	(void)tlsf;
+	(void)mem;
+	(void)bytes;
+#endif
+}
+
+static void link_table_remove(tlsf_t *tlsf, void *mem, size_t bytes)
+{
+#if TLSF_OOB_LINKS
+	free_link_t *table = tlsf_cast(free_link_t *, tlsf_cast(char *, mem) + link_table_offset(bytes));
+	const size_t count = bytes >> LINK_GRANULE_LOG2;
+	free_link_t **chain = &tlsf->links_free;
+	size_t i;
+
+	/* Drop the unused entries of the table */
+	while (*chain != NULL) {
+		if (*chain >= table && *chain < table + count) {
+			*chain = (*chain)->next;
+		} else {
+			chain = &(*chain)->next;
+		}
+	}
+
+	/* Move the entries in use */
+	for (i = 0; i < count; i++) {
+		if (table[i].block != NULL) {
+			free_link_t *link = tlsf->links_free;
+			tlsf_assert(link && "link table exhausted");
+			tlsf->links_free = link->next;
+
+			*link = table[i];
+			link->prev->next = link;
+			link->next->prev = link;
+			ASAN_UNPOISON_MEMORY_REGION(&link->block->free_list, sizeof(struct free_list));
+			link->block->free_list.next_free = tlsf_cast(block_header_t *, tlsf_cast(void *, link));
+			ASAN_POISON_MEMORY_REGION(&link->block->free_list, sizeof(struct free_list));
+		}
+	}
+#else
+	(void)tlsf;
+	(void)mem;
+	(void)bytes;
+#endif
+}
+
+/* Size of the free block that spans a pool of the given size */
+static size_t pool_block_size(size_t bytes)
+{
+	const size_t pool_overhead = tlsf_pool_overhead();
+	const size_t table_offset = link_table_offset(bytes);
+
+	return table_offset > pool_overhead ?
+		align_down(table_offset - pool_overhead, ALIGN_SIZE) : 0;
+}
+
+/* Make the memory of a pool one free block, followed by the sentinel */
+static void pool_construct(tlsf_t *tlsf, void *mem, size_t bytes, int zeroed)
+{
+	block_header_t *block;
+	block_header_t *next;
+
+	link_table_add(tlsf, mem, bytes);
+
+	/*
+	 * Create the main free block. Offset the start of the block slightly
+	 * so that the prev_phys_block field falls into the pool header -
+	 * it will never be used.
+	 */
+	block = first_block(mem);
+	block_set_size(block, pool_block_size(bytes));
+	block_set_free(block);
+	block_set_prev_used(block);
+	block_set_purged(block, zeroed);
+	block_insert(tlsf, block);
+	block_set_heap(block, tlsf);
+
+	/* Split the block to create a zero-size sentinel block */
+	next = block_next(block);
+	block_link_next(block);
+	block_set_size(next, 0);
+	block_set_used(next);
+	block_set_prev_free(next);
+	block_set_purged(next, 0);
+	block_set_heap(next, tlsf);
+
+	ASAN_POISON_MEMORY_REGION(block_to_ptr(block), block_size(block));
+	ASAN_POISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+	ASAN_POISON_MEMORY_REGION(&next->metadata, sizeof(struct metadata));
+}
+
+static tlsf_pool_t *heap_add_pool(tlsf_t *tlsf, void *mem, size_t bytes, int mapped, int zeroed)
+{
+	pool_header_t *pool = tlsf_cast(pool_header_t *, mem);
+
+	const size_t pool_overhead = tlsf_pool_overhead();
+	const size_t pool_bytes = pool_block_size(bytes);
+
+	if (((ptrdiff_t)mem % ALIGN_SIZE) != 0) {
+		printf("tlsf_add_pool: Memory must be aligned by %u bytes.\n",
+			(unsigned int)ALIGN_SIZE);
+		return NULL;
+	}
+
+	if (pool_bytes < block_size_min || pool_bytes > block_size_max) {
+		printf("tlsf_add_pool: Memory size must be between %zu and %zu bytes.\n",
+			pool_overhead + block_size_min,
 			pool_overhead + block_size_max);
 		return NULL;
 	}
 
-	/*
-	 * Create the main free block. Offset the start of the block slightly
-	 * so that the prev_phys_block field falls outside of the pool -
-	 * it will never be used.
-	 */
-	block = first_block(mem);
-	block_set_size(block, pool_bytes);
-	block_set_free(block);
-	block_set_prev_used(block);
-	block_insert(tlsf, block);
-	block->metadata.tlsf = tlsf;
+	if (!pool_in_reach(tlsf, mem, bytes)) {
+		printf("tlsf_add_pool: Memory must lie within %zu bytes of the control structure.\n",
+			head_reach);
+		return NULL;
+	}
+
+#if TLSF_COMPACT_HEADER
+	/* Blocks of this pool find their heap through the registry */
+	if (region_register(tlsf, mem, tlsf_cast(char *, mem) + bytes) != 0) {
+		return NULL;
+	}
+#endif
+
+	pool_construct(tlsf, mem, bytes, zeroed);
+
+	pool->next = tlsf->pools;
+	pool->bytes = bytes;
+	pool->mapped = mapped;
+	tlsf->pools = pool;
+	tlsf->pool_bytes += bytes;
+
+	return mem;
+}
+
+tlsf_pool_t *tlsf_add_pool(tlsf_t *tlsf, void *mem, size_t bytes)
+{
+	heap_lock(tlsf);
+	tlsf_pool_t *pool = heap_add_pool(tlsf, mem, bytes, 0, 0);
+	heap_unlock(tlsf);
+	return pool;
+}
+
+tlsf_pool_t *tlsf_add_pool_zeroed(tlsf_t *tlsf, void *mem, size_t bytes)
+{
+	heap_lock(tlsf);
+	tlsf_pool_t *pool = heap_add_pool(tlsf, mem, bytes, 0, 1);
+	heap_unlock(tlsf);
+	return pool;
+}
+
+static void heap_remove_pool(tlsf_t *tlsf, pool_header_t *pool)
+{
+	block_header_t *block = first_block(pool);
+	ASAN_UNPOISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+	block_header_t *next = block_next(block);
+	ASAN_UNPOISON_MEMORY_REGION(&next->metadata, sizeof(struct metadata));
+
+	int fl = 0;
+	int sl = 0;
+
+	tlsf_assert(block_is_free(block) && "block should be free");
+	tlsf_assert(!block_is_free(next) && "next block should not be free");
+	tlsf_assert(block_size(next) == 0 && "next block size should be zero");
+
+	mapping_search(block_size(block), &fl, &sl);
+	remove_free_block(tlsf, block, fl, sl);
+
+	ASAN_UNPOISON_MEMORY_REGION(block_to_ptr(block), block_size(block));
+
+	pool_header_t **link = &tlsf->pools;
+	while (*link != pool) {
+		link = &(*link)->next;
+	}
+	*link = (*link)->next;
+	tlsf->pool_bytes -= pool->bytes;
+	link_table_remove(tlsf, pool, pool->bytes);
+#if TLSF_COMPACT_HEADER
+	region_unregister(pool, tlsf_cast(char *, pool) + pool->bytes);
+#endif
+}
+
+void tlsf_remove_pool(tlsf_t *tlsf, tlsf_pool_t *pool)
+{
+	heap_lock(tlsf);
+	/* Blocks of this pool may still be waiting on the remote or quick lists */
+	remote_drain(tlsf);
+	quick_release_all(tlsf);
+	heap_remove_pool(tlsf, tlsf_cast(pool_header_t *, pool));
+	heap_unlock(tlsf);
+}
+
+/*
+ * Drop all allocations at once: every pool becomes one free block again.
+ * The cost depends on the number of pools, not on the allocations, as
+ * the list heads need not be cleared, see list_head. The slab arena is
+ * dropped with the rest, see tlsf_reset.
+ */
+static void heap_reset(tlsf_t *tlsf)
+{
+	pool_header_t *pool;
+	int i;
+
+	atomic_store_explicit(&tlsf->remote_free, NULL, memory_order_relaxed);
+
+	tlsf->fl_bitmap = 0;
+	for (i = 0; i < FL_INDEX_COUNT; i++) {
+		tlsf->sl_bitmap[i] = 0;
+	}
+#if TLSF_OOB_LINKS
+	tlsf->link_null.next = tlsf->link_null.prev = &tlsf->link_null;
+	tlsf->links_free = NULL;
+#endif
+#if TLSF_STATISTIC
+	tlsf->stats.free_bytes = 0;
+	tlsf->stats.free_blocks = 0;
+	memset(tlsf->census_blocks, 0, sizeof(tlsf->census_blocks));
+	memset(tlsf->census_bytes, 0, sizeof(tlsf->census_bytes));
+#endif
+
+	tlsf->slab_start = tlsf->slab_end = tlsf->slab_bump = NULL;
+	tlsf->slab_pages = NULL;
+	for (i = 0; i < SL_INDEX_COUNT; i++) {
+		tlsf->slab_partial[i] = NULL;
+	}
+
+	for (i = 0; i < QUICK_CLASS_COUNT; i++) {
+		tlsf->quick[i] = NULL;
+		tlsf->quick_count[i] = 0;
+	}
+	tlsf->quick_bytes = 0;
+
+	/* Pages purged by tlsf_trim are no longer known to be zero */
+	for (pool = tlsf->pools; pool != NULL; pool = pool->next) {
+		ASAN_UNPOISON_MEMORY_REGION(pool, pool->bytes);
+		pool_construct(tlsf, pool, pool->bytes, 0);
+	}
+}
+
+/* A pool is empty when its first block is free and ends at the sentinel */
+static int pool_is_empty(const pool_header_t *pool)
+{
+	block_header_t *block = first_block(pool);
+	int empty;
+
+	ASAN_UNPOISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+	empty = block_is_free(block);
+	if (empty) {
+		block_header_t *next = block_next(block);
+		ASAN_UNPOISON_MEMORY_REGION(&next->metadata, sizeof(struct metadata));
+		empty = block_size(next) == 0;
+		ASAN_POISON_MEMORY_REGION(&next->metadata, sizeof(struct metadata));
+	}
+	ASAN_POISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+	return empty;
+}
+
+/*
+ * Map a pool from the region provider. With TLSF_COMPACT_CONTROL, the
+ * default provider would put it anywhere, usually far from a control
+ * structure in static or malloc memory, so hints near the control
+ * structure are tried until a mapping lands within reach of its heads.
+ */
+static void *heap_map(tlsf_t *tlsf, size_t bytes)
+{
+	void *mem = tlsf->map(bytes, tlsf->map_user);
+#if TLSF_COMPACT_CONTROL && HAVE_MMAP
+	const uintptr_t base = tlsf_cast(uintptr_t, tlsf);
+	int i;
+
+	if (tlsf->map != tlsf_provider_mmap || bytes > head_reach / 2) {
+		return mem;
+	}
+	const uintptr_t step = align_down((head_reach - bytes) / (GROW_NEAR_TRIES + 1), GROW_GRANULE);
+	for (i = 0; mem != NULL && !pool_in_reach(tlsf, mem, bytes) && i < 2 * GROW_NEAR_TRIES; i++) {
+		/* Alternate between hints above and below the control structure */
+		const uintptr_t offset = step * tlsf_cast(uintptr_t, i / 2 + 1);
+		uintptr_t hint = 0;
+
+		if (i % 2 == 0 && base <= UINTPTR_MAX - offset - bytes) {
+			hint = align_down(base + offset, GROW_GRANULE);
+		} else if (i % 2 == 1 && base >= offset) {
+			hint = align_down(base - offset, GROW_GRANULE);
+		}
+		munmap(mem, bytes);
+		mem = mmap(tlsf_cast(void *, hint), bytes, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED) {
+			mem = NULL;
+		}
+	}
+#endif
+	return mem;
+}
+
+/*
+ * Map a new pool from the region provider, large enough for a free block
+ * of the given size. Pool sizes grow geometrically, as long as the pools
+ * of the heap stay within the maximum heap size.
+ */
+static int heap_grow(tlsf_t *tlsf, size_t size)
+{
+	if (tlsf->map == NULL || size > block_size_max / 2) {
+		return -1;
+	}
+
+	const size_t need = align_up(link_pool_size(mapping_round(size) + tlsf_pool_overhead()), GROW_GRANULE);
+	size_t bytes = align_up(tlsf_max(need, tlsf->grow_next), GROW_GRANULE);
+	bytes = tlsf_min(bytes, block_size_max);
+
+	if (tlsf->grow_max != 0) {
+		const size_t room = tlsf->grow_max > tlsf->pool_bytes ?
+			tlsf->grow_max - tlsf->pool_bytes : 0;
+		bytes = tlsf_min(bytes, align_down(room, GROW_GRANULE));
+	}
+	if (bytes < need) {
+		return -1;
+	}
+
+	void *mem = heap_map(tlsf, bytes);
+	if (mem == NULL) {
+		return -1;
+	}
+
+	/* A provider that maps out of reach would fail every request again */
+	if (!pool_in_reach(tlsf, mem, bytes)) {
+		printf("tlsf: Mapped pools are out of reach of the control structure, growth stops.\n");
+		if (tlsf->unmap != NULL) {
+			tlsf->unmap(mem, bytes, tlsf->map_user);
+		}
+		tlsf->map = NULL;
+		return -1;
+	}
+	/* Fresh anonymous mappings are zero filled */
+	if (heap_add_pool(tlsf, mem, bytes, 1, tlsf->map == tlsf_provider_mmap) == NULL) {
+		if (tlsf->unmap != NULL) {
+			tlsf->unmap(mem, bytes, tlsf->map_user);
+		}
+		return -1;
+	}
+
+	tlsf->grow_next = bytes < block_size_max / tlsf->grow_factor ?
+		bytes * tlsf->grow_factor : block_size_max;
+	return 0;
+}
+
+/*
+ * Gap between the start of a free block and the first aligned address
+ * that leaves either no leading block or one large enough to be free.
+ */
+// ASAN pre: unpoisoned metadata block
+static size_t block_align_gap(const block_header_t *block, size_t align)
+{
+	const size_t gap_minimum = sizeof(block_header_t);
+	void *ptr = block_to_ptr(block);
+	void *aligned = align_ptr(ptr, align);
+	size_t gap = tlsf_cast(size_t,
+		tlsf_cast(ptrdiff_t, aligned) - tlsf_cast(ptrdiff_t, ptr));
+
+	/* If gap size is too small, offset to next aligned boundary */
+	if (gap > 0 && gap < gap_minimum) {
+		const size_t gap_remain = gap_minimum - gap;
+		const size_t offset = tlsf_max(gap_remain, align);
+		const void *next_aligned = tlsf_cast(void *,
+			tlsf_cast(ptrdiff_t, aligned) + offset);
+
+		aligned = align_ptr(next_aligned, align);
+		gap = tlsf_cast(size_t,
+			tlsf_cast(ptrdiff_t, aligned) - tlsf_cast(ptrdiff_t, ptr));
+	}
+	return gap;
+}
+
+/*
+ * Look for a free block that already holds an aligned block of the given
+ * size, starting from the size class of the request. Blocks whose
+ * addresses happen to line up are used without the extra room that
+ * block_locate_free must ask for to cover any alignment.
+ */
+static block_header_t *block_locate_aligned(tlsf_t *tlsf, size_t align, size_t size)
+{
+	unsigned int probed = 0;
+	int fl = 0;
+	int sl = 0;
+
+	mapping_search(size, &fl, &sl);
+	while (probed < ALIGN_PROBE_MAX && fl < FL_INDEX_COUNT) {
+		block_header_t *block = search_suitable_block(tlsf, &fl, &sl);
+
+		while (block != NULL && block != &tlsf->block_null && probed++ < ALIGN_PROBE_MAX) {
+			ASAN_UNPOISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+			const size_t gap = block_align_gap(block, align);
+			if (block_size(block) >= gap + size && (gap == 0 || block_can_split(block, gap))) {
+				remove_free_block(tlsf, block, fl, sl);
+				return block;
+			}
+			ASAN_POISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+			block = block_next_free(block);
+		}
+		if (block == NULL) {
+			break;
+		}
+		if (++sl == SL_INDEX_COUNT) {
+			sl = 0;
+			fl++;
+		}
+	}
+	return NULL;
+}
+
+/* Locate a free block, growing the heap if none fits */
+// ASAN post: unpoisoned metadata block
+static block_header_t *block_locate_grow(tlsf_t *tlsf, size_t size)
+{
+	block_header_t *block = block_locate_free(tlsf, size);
+	/* Coalescing the quick lists may make room */
+	if (block == NULL && size > 0 && tlsf->quick_bytes != 0) {
+		quick_release_all(tlsf);
+		block = block_locate_free(tlsf, size);
+	}
+	if (block == NULL && size > 0 && heap_grow(tlsf, size) == 0) {
+		block = block_locate_free(tlsf, size);
+	}
+	return block;
+}
+
+void tlsf_set_provider(tlsf_t *tlsf, tlsf_map_fn map, tlsf_unmap_fn unmap, void *user)
+{
+	heap_lock(tlsf);
+	tlsf->map = map;
+	tlsf->unmap = unmap;
+	tlsf->map_user = user;
+	heap_unlock(tlsf);
+}
+
+void tlsf_set_growth(tlsf_t *tlsf, size_t initial, unsigned int factor, size_t max_bytes)
+{
+	heap_lock(tlsf);
+	tlsf->grow_next = initial ? initial : GROW_SIZE_DEFAULT;
+	tlsf->grow_factor = factor ? factor : 1;
+	tlsf->grow_max = max_bytes;
+	heap_unlock(tlsf);
+}
+
+void tlsf_set_fit(tlsf_t *tlsf, unsigned int probe, size_t split_min)
+{
+	heap_lock(tlsf);
+	tlsf->fit_probe = probe;
+	tlsf->split_min = split_min;
+	heap_unlock(tlsf);
+}
+
+void tlsf_set_placement(tlsf_t *tlsf, int policy)
+{
+	heap_lock(tlsf);
+	tlsf->placement = policy;
+	heap_unlock(tlsf);
+}
+
+void tlsf_set_quick(tlsf_t *tlsf, unsigned int max_blocks, size_t max_bytes)
+{
+	heap_lock(tlsf);
+	quick_release_all(tlsf);
+	tlsf->quick_max = max_blocks;
+	tlsf->quick_bytes_max = max_bytes;
+	heap_unlock(tlsf);
+}
+
+void tlsf_set_huge(tlsf_t *tlsf, size_t threshold)
+{
+	heap_lock(tlsf);
+	tlsf->huge_threshold = threshold;
+	heap_unlock(tlsf);
+}
+
+void *tlsf_provider_mmap(size_t bytes, void *user)
+{
+	void *mem = NULL;
+	(void)user;
+#if HAVE_MMAP
+	mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		mem = NULL;
+	}
+#else
+	(void)bytes;
+#endif
+	return mem;
+}
+
+void tlsf_provider_munmap(void *mem, size_t bytes, void *user)
+{
+	(void)user;
+#if HAVE_MMAP
+	munmap(mem, bytes);
+#else
+	(void)mem;
+	(void)bytes;
+#endif
+}
+
+/*
+ * Pool mapping.
+ *
+ * Each option degrades gracefully where the system lacks it, except for
+ * TLSF_MAP_LOCK: callers that ask for locked memory cannot do with less.
+ * Transparent huge pages must be requested before the pages are faulted
+ * in, so such pools are populated by hand after madvise.
+ */
+
+#if HAVE_MMAP
+static size_t map_pool_size(size_t bytes, int flags)
+{
+	return align_up(bytes, (flags & TLSF_MAP_HUGETLB) ? HUGE_PAGE_SIZE : GROW_GRANULE);
+}
+#endif
+
+void *tlsf_map_pool(size_t bytes, int flags)
+{
+	void *mem = NULL;
+#if HAVE_MMAP
+	const int prot = PROT_READ | PROT_WRITE;
+	int mflags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+	bytes = map_pool_size(bytes, flags);
+
+#if defined (MAP_POPULATE)
+	if ((flags & TLSF_MAP_POPULATE) && !(flags & TLSF_MAP_HUGEPAGE)) {
+		mflags |= MAP_POPULATE;
+	}
+#endif
+
+	mem = MAP_FAILED;
+#if defined (MAP_HUGETLB)
+	if (flags & TLSF_MAP_HUGETLB) {
+		mem = mmap(NULL, bytes, prot, mflags | MAP_HUGETLB, -1, 0);
+	}
+#endif
+	if (mem == MAP_FAILED) {
+		mem = mmap(NULL, bytes, prot, mflags, -1, 0);
+	}
+	if (mem == MAP_FAILED) {
+		return NULL;
+	}
+
+	if (flags & TLSF_MAP_HUGEPAGE) {
+#if HAVE_MADVISE && defined (MADV_HUGEPAGE)
+		madvise(mem, bytes, MADV_HUGEPAGE);
+#endif
+		if (flags & TLSF_MAP_POPULATE) {
+			volatile char *page;
+			for (page = mem; page < tlsf_cast(char *, mem) + bytes; page += GROW_GRANULE) {
+				*page = 0;
+			}
+		}
+	}
+
+	if (flags & TLSF_MAP_LOCK) {
+#if HAVE_MLOCK
+		if (mlock(mem, bytes) != 0) {
+			printf("tlsf_map_pool: Could not lock %zu bytes in memory.\n", bytes);
+			munmap(mem, bytes);
+			mem = NULL;
+		}
+#else
+		printf("tlsf_map_pool: Locking memory is not supported.\n");
+		munmap(mem, bytes);
+		mem = NULL;
+#endif
+	}
+#else
+	(void)bytes;
+	(void)flags;
+#endif
+	return mem;
+}
+
+void tlsf_unmap_pool(void *mem, size_t bytes, int flags)
+{
+#if HAVE_MMAP
+	if (mem != NULL) {
+		munmap(mem, map_pool_size(bytes, flags));
+	}
+#else
+	(void)mem;
+	(void)bytes;
+	(void)flags;
+#endif
+}
+
+/*
+ * Trimming.
+ *
+ * The whole pages inside a free block, past its free list links and
+ * before the trailer that points back at it, are never touched while it
+ * stays free, and can be handed back to the system. Purged blocks are
+ * marked, so that they are not purged again; the mark is dropped as
+ * soon as the block is coalesced or released after use. Building with
+ * TLSF_TRIM_LAZY uses MADV_FREE, which lets the system reclaim the pages
+ * only under memory pressure.
+ *
+ * Pages purged with MADV_DONTNEED read as zero, as do the pages of zero
+ * filled pools, which start out marked. tlsf_calloc skips them, unless
+ * the pages may have been purged lazily and come back with old contents.
+ */
+
+#if HAVE_MADVISE
+#if defined (TLSF_TRIM_LAZY) && defined (MADV_FREE)
+#define TLSF_TRIM_ADVICE MADV_FREE
+#else
+#define TLSF_TRIM_ADVICE MADV_DONTNEED
+#endif
+#endif
+
+#if defined (TLSF_TRIM_LAZY)
+static const int purged_is_zero = 0;
+#else
+static const int purged_is_zero = 1;
+#endif
+
+/* Granularity of purged ranges */
+static size_t trim_page_size(void)
+{
+#if HAVE_MADVISE
+	return tlsf_cast(size_t, sysconf(_SC_PAGESIZE));
+#else
+	return GROW_GRANULE;
+#endif
+}
+
+// ASAN pre: unpoisoned metadata block
+static size_t block_purge(block_header_t *block)
+{
+	size_t purged = 0;
+#if HAVE_MADVISE
+	const size_t page = trim_page_size();
+	const size_t start = align_up(tlsf_cast(size_t, block_to_ptr(block))
+		+ sizeof(struct free_list), page);
+	const size_t end = align_down(tlsf_cast(size_t, block_next(block)), page);
+
+	if (start < end && madvise(tlsf_cast(void *, start), end - start, TLSF_TRIM_ADVICE) == 0) {
+		block_set_purged(block, 1);
+		purged = end - start;
+	}
+#else
+	(void)block;
+#endif
+	return purged;
+}
+
+/* Zero bytes at p, bypassing the cache for large sizes */
+static void zero_fill(void *p, size_t bytes)
+{
+#if defined (__SSE2__)
+	if (bytes >= ZERO_STREAM_SIZE) {
+		char *start = align_ptr(p, sizeof(__m128i));
+		char *end = tlsf_cast(char *, align_down(tlsf_cast(size_t, p) + bytes, sizeof(__m128i)));
+		const __m128i zero = _mm_setzero_si128();
+
+		memset(p, 0, tlsf_cast(size_t, start - tlsf_cast(char *, p)));
+		for (char *q = start; q < end; q += sizeof(__m128i)) {
+			_mm_stream_si128(tlsf_cast(__m128i *, q), zero);
+		}
+		_mm_sfence();
+		memset(end, 0, tlsf_cast(size_t, tlsf_cast(char *, p) + bytes - end));
+		return;
+	}
+#endif
+	memset(p, 0, bytes);
+}
+
+/*
+ * Zero the first bytes of a used block, except for pages known to be zero
+ * when the block was carved from a purged free block
+ */
+// ASAN pre: poisoned metadata block, unpoisoned data
+static void block_zero(block_header_t *block, size_t bytes, int purged)
+{
+	const size_t from = tlsf_cast(size_t, block_to_ptr(block));
+	const size_t to = from + bytes;
+	size_t start = to;
+	size_t end = to;
+
+	if (purged_is_zero && purged) {
+		const size_t page = trim_page_size();
+		start = align_up(from + sizeof(struct free_list), page);
+		ASAN_UNPOISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+		end = tlsf_min(align_down(tlsf_cast(size_t, block_next(block)), page), to);
+		ASAN_POISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+	}
+
+	if (start < end) {
+		zero_fill(tlsf_cast(void *, from), start - from);
+		zero_fill(tlsf_cast(void *, end), to - end);
+	} else {
+		zero_fill(tlsf_cast(void *, from), bytes);
+	}
+}
+
+size_t tlsf_trim(tlsf_t *tlsf, size_t keep_bytes)
+{
+	size_t kept = 0;
+	size_t purged = 0;
+	int fl, sl;
+
+	heap_lock(tlsf);
+	remote_drain(tlsf);
+	quick_release_all(tlsf);
+
+	/* Return empty pools to the region provider */
+	pool_header_t **link = &tlsf->pools;
+	while (*link != NULL) {
+		pool_header_t *pool = *link;
+		if (pool->mapped && tlsf->unmap != NULL && pool_is_empty(pool)) {
+			const size_t bytes = pool->bytes;
+			heap_remove_pool(tlsf, pool);
+			ASAN_UNPOISON_MEMORY_REGION(pool, bytes);
+			tlsf->unmap(pool, bytes, tlsf->map_user);
+			purged += bytes;
+		} else {
+			link = &pool->next;
+		}
+	}
+
+	/* Keep the smaller blocks resident, up to keep_bytes in total */
+	for (fl = 0; fl < FL_INDEX_COUNT; fl++) {
+		for (sl = 0; sl < SL_INDEX_COUNT; sl++) {
+			block_header_t *block = list_head(tlsf, fl, sl);
+
+			while (block != &tlsf->block_null) {
+				ASAN_UNPOISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+				block_header_t *next = block_next_free(block);
+
+				if (!block_is_purged(block)) {
+					const size_t size = block_size(block);
+					if (kept + size <= keep_bytes) {
+						kept += size;
+					} else {
+						purged += block_purge(block);
+					}
+				}
+
+				ASAN_POISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+				block = next;
+			}
+		}
+	}
+
+	heap_unlock(tlsf);
+	return purged;
+}
+
+/*
+ * TLSF main interface.
+ */
+
+#if _DEBUG
+static int test_ffs_fls()
+{
+	/* Verify ffs/fls work properly */
+	int rv = 0;
+	rv += (tlsf_ffs(0) == -1) ? 0 : 0x1;
+	rv += (tlsf_fls(0) == -1) ? 0 : 0x2;
+	rv += (tlsf_ffs(1) == 0) ? 0 : 0x4;
+	rv += (tlsf_fls(1) == 0) ? 0 : 0x8;
+	rv += (tlsf_ffs(0x80000000) == 31) ? 0 : 0x10;
+	rv += (tlsf_ffs(0x80008000) == 15) ? 0 : 0x20;
+	rv += (tlsf_fls(0x80000008) == 31) ? 0 : 0x40;
+	rv += (tlsf_fls(0x7FFFFFFF) == 30) ? 0 : 0x80;
+
+#if defined (TLSF_64BIT)
+	rv += (tlsf_fls_sizet(0x80000000) == 31) ? 0 : 0x100;
+	rv += (tlsf_fls_sizet(0x100000000) == 32) ? 0 : 0x200;
+	rv += (tlsf_fls_sizet(0xffffffffffffffff) == 63) ? 0 : 0x400;
+	rv += (tlsf_ffs_sizet(0x100000000) == 32) ? 0 : 0x800;
+	rv += (tlsf_ffs_sizet(0x8000000000000000) == 63) ? 0 : 0x1000;
+#endif
+
+	if (rv) {
+		printf("test_ffs_fls: %x ffs/fls tests failed.\n", rv);
+	}
+	return rv;
+}
+#endif
+
+tlsf_t *tlsf_create(void *mem)
+{
+#if _DEBUG
+	if (test_ffs_fls()) {
+		return NULL;
+	}
+#endif
+
+	if (((ptrdiff_t)mem % ALIGN_SIZE) != 0) {
+		printf("tlsf_create: Memory must be aligned to %u bytes.\n",
+			(unsigned int)ALIGN_SIZE);
+		return NULL;
+	}
+
+	control_construct(tlsf_cast(tlsf_t *, mem));
+
+	return tlsf_cast(tlsf_t *, mem);
+}
+
+tlsf_t *tlsf_create_with_pool(void *mem, size_t bytes)
+{
+	tlsf_t *tlsf = tlsf_create(mem);
+	tlsf_add_pool(tlsf, (char *)mem + tlsf_size(), bytes - tlsf_size());
+	return tlsf;
+}
+
+tlsf_t *tlsf_create_locked(void *mem)
+{
+	tlsf_t *tlsf = tlsf_create(mem);
+	if (tlsf != NULL) {
+		TLSF_CREATE_LOCK(&tlsf->lock);
+		atomic_init(&tlsf->spin_limit, 0);
+		memset(&tlsf->lock_stats, 0, sizeof(tlsf->lock_stats));
+		tlsf->locked = 1;
+	}
+	return tlsf;
+}
+
+tlsf_t *tlsf_create_with_pool_locked(void *mem, size_t bytes)
+{
+	tlsf_t *tlsf = tlsf_create_locked(mem);
+	tlsf_add_pool(tlsf, (char *)mem + tlsf_size(), bytes - tlsf_size());
+	return tlsf;
+}
+
+int tlsf_get_stats(tlsf_t *tlsf, tlsf_stats_t *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+#if TLSF_STATISTIC
+	heap_lock(tlsf);
+	*stats = tlsf->stats;
+	stats->pool_bytes = tlsf->pool_bytes;
+	stats->used_bytes = tlsf->pool_bytes - tlsf->stats.free_bytes;
+	heap_unlock(tlsf);
+	return 0;
+#else
+	(void)tlsf;
+	return -1;
+#endif
+}
+
+void tlsf_get_lock_stats(tlsf_t *tlsf, tlsf_lock_stats_t *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	if (tlsf->locked) {
+		heap_lock(tlsf);
+		*stats = tlsf->lock_stats;
+		heap_unlock(tlsf);
+	}
+}
+
+void tlsf_destroy(tlsf_t *tlsf)
+{
+	ASAN_UNPOISON_MEMORY_REGION(&tlsf->block_null.free_list, sizeof(struct free_list));
+
+	if (tlsf->slab_start != NULL) {
+		region_unregister(tlsf->slab_start, tlsf->slab_end);
+	}
+
+	/* Return the pools that were mapped from the region provider */
+	pool_header_t *pool = tlsf->pools;
+	while (pool != NULL) {
+		pool_header_t *next = pool->next;
+#if TLSF_COMPACT_HEADER
+		region_unregister(pool, tlsf_cast(char *, pool) + pool->bytes);
+#endif
+		if (pool->mapped && tlsf->unmap != NULL) {
+			ASAN_UNPOISON_MEMORY_REGION(pool, pool->bytes);
+			tlsf->unmap(pool, pool->bytes, tlsf->map_user);
+		}
+		pool = next;
+	}
+	tlsf->pools = NULL;
+
+	if (tlsf->locked) {
+		TLSF_DESTROY_LOCK(&tlsf->lock);
+		tlsf->locked = 0;
+	}
+}
+
+tlsf_pool_t *tlsf_get_pool(tlsf_t *tlsf)
+{
+	return tlsf_cast(tlsf_pool_t *, (char *)tlsf + tlsf_size());
+}
+
+/*
+ * Allocate size bytes, and report whether the block was carved from a
+ * purged free block, as the mark is dropped once the block is used
+ */
+static void *heap_malloc_purged(tlsf_t *tlsf, size_t size, int *purged)
+{
+	const size_t adjust = adjust_request_size(size, ALIGN_SIZE);
+	void *p = NULL;
+	*purged = 0;
+	remote_drain(tlsf);
+
+	/* Huge and slab requests fall back to the pools */
+	if (huge_fits(tlsf, size)) {
+		p = huge_malloc(tlsf, ALIGN_SIZE, size);
+	} else if (slab_fits(tlsf, size)) {
+		p = slab_malloc(tlsf, size);
+	}
+	if (p == NULL) {
+		block_header_t *block = quick_pop(tlsf, adjust);
+		if (block != NULL) {
+			p = block_to_ptr(block);
+			ASAN_UNPOISON_MEMORY_REGION(p, block_size(block));
+			ASAN_POISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+		}
+	}
+	if (p == NULL) {
+		block_header_t *block = block_locate_grow(tlsf, adjust);
+		*purged = block != NULL && block_is_purged(block);
+		p = block_prepare_used(tlsf, block, adjust);
+	}
+
+	if (p != NULL) {
+		tlsf_stat_add(tlsf, stats.malloc_count, 1);
+	}
+	return p;
+}
+
+static void *heap_malloc(tlsf_t *tlsf, size_t size)
+{
+	int purged;
+	return heap_malloc_purged(tlsf, size, &purged);
+}
+
+/* Huge blocks are fresh mappings, and need no clearing */
+static void *heap_calloc(tlsf_t *tlsf, size_t count, size_t size)
+{
+	const size_t bytes = count * size;
+	void *p = NULL;
+	int purged;
+
+	if (size != 0 && bytes / size != count) {
+		return NULL;
+	}
+
+	p = heap_malloc_purged(tlsf, bytes, &purged);
+	if (p != NULL && slab_owns(tlsf, p)) {
+		memset(p, 0, bytes);
+	} else if (p != NULL && !block_is_huge(block_from_ptr(p))) {
+		block_zero(block_from_ptr(p), bytes, purged);
+	}
+	return p;
+}
+
+static void *heap_memalign(tlsf_t *tlsf, size_t align, size_t size)
+{
+	const size_t adjust = adjust_request_size(size, ALIGN_SIZE);
+
+	/*
+	 * We must allocate an additional minimum block size bytes so that if
+	 * our free block will leave an alignment gap which is smaller, we can
+	 * trim a leading free block and release it back to the pool. We must
+	 * do this because the previous physical block is in use, therefore
+	 * the prev_phys_block field is not valid, and we can't simply adjust
+	 * the size of that block. Splitting off the gap also needs a whole
+	 * block header's worth of room behind it.
+	 */
+	const size_t gap_minimum = sizeof(block_header_t);
+	const size_t size_with_gap = adjust_request_size(tlsf_max(adjust, gap_minimum) + align + gap_minimum, align);
+
+	/*
+	 * If alignment is less than or equals base alignment, we're done.
+	 * If we requested 0 bytes, return null, as tlsf_malloc(0) does.
+	 */
+	const size_t aligned_size = (adjust && align > ALIGN_SIZE) ? size_with_gap : adjust;
+
+	remote_drain(tlsf);
+
+	if (huge_fits(tlsf, size)) {
+		void *p = huge_malloc(tlsf, align, size);
+		if (p != NULL) {
+			tlsf_stat_add(tlsf, stats.malloc_count, 1);
+			return p;
+		}
+	}
+
+	block_header_t *block = NULL;
+	if (aligned_size != adjust) {
+		block = block_locate_aligned(tlsf, align, adjust);
+	}
+	if (block == NULL) {
+		block = block_locate_grow(tlsf, aligned_size);
+	}
+
+	/* This can't be a static assert */
+	tlsf_assert(sizeof(block_header_t) <= block_size_min + metadata_size);
+
+	if (block != NULL) {
+		const size_t gap = block_align_gap(block, align);
+
+		if (gap > 0) {
+			tlsf_assert(gap >= gap_minimum && "gap size too small");
+			block_trim_free_leading(tlsf, &block, gap);
+		}
+		tlsf_stat_add(tlsf, stats.malloc_count, 1);
+	}
+
+	return block_prepare_used(tlsf, block, adjust);
+}
+
+/* Free a block owned by this heap */
+static void heap_free(tlsf_t *tlsf, void *ptr)
+{
+	block_header_t *block = block_from_ptr(ptr);
+
+	remote_drain(tlsf);
+	tlsf_stat_add(tlsf, stats.free_count, 1);
+
+	if (slab_owns(tlsf, ptr)) {
+		slab_free(tlsf, ptr);
+		return;
+	}
+	if (block_is_huge(block)) {
+		huge_free(block);
+		return;
+	}
+
+	ASAN_UNPOISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+	ASAN_POISON_MEMORY_REGION(ptr, block_size(block));
+	if (!quick_push(tlsf, block)) {
+		block_release(tlsf, block);
+	}
+	// ASAN poison data block
+}
+
+/*
+ * Allocate up to count blocks of the same size. Each search asks for one
+ * free block that can hold all outstanding blocks, falling back to one
+ * that holds at least a single block, and carves as many as fit from it.
+ */
+static size_t heap_malloc_batch(tlsf_t *tlsf, size_t size, size_t count, void **ptrs)
+{
+	const size_t adjust = adjust_request_size(size, ALIGN_SIZE);
+	size_t done = 0;
+
+	remote_drain(tlsf);
+
+	if (slab_fits(tlsf, size)) {
+		while (done < count && (ptrs[done] = slab_malloc(tlsf, size)) != NULL) {
+			done++;
+		}
+	}
+
+	while (adjust && done < count) {
+		const size_t stride = adjust + metadata_size;
+		const size_t left = tlsf_min(count - done, block_size_max / stride);
+		block_header_t *block = NULL;
+
+		if (left > 1) {
+			block = block_locate_free(tlsf, left * stride - metadata_size);
+		}
+		if (block == NULL) {
+			block = block_locate_grow(tlsf, adjust);
+		}
+		if (block == NULL) {
+			break;
+		}
+		done += block_carve(tlsf, block, adjust, count - done, ptrs + done);
+	}
+
+	tlsf_stat_add(tlsf, stats.malloc_count, done);
+	return done;
+}
+
+static int ptr_compare(const void *a, const void *b)
+{
+	const char *pa = *tlsf_cast(char *const *, a);
+	const char *pb = *tlsf_cast(char *const *, b);
+	return (pa > pb) - (pa < pb);
+}
+
+/*
+ * Free count blocks owned by this heap. Sorting by address lines up
+ * physical neighbors, so each run of adjacent blocks is folded into its
+ * first block and released, coalesced and inserted only once.
+ */
+static void heap_free_batch(tlsf_t *tlsf, void **ptrs, size_t count)
+{
+	size_t i = 0;
+
+	remote_drain(tlsf);
+	tlsf_stat_add(tlsf, stats.free_count, count);
+	qsort(ptrs, count, sizeof(void *), ptr_compare);
+
+	while (i < count) {
+		void *ptr = ptrs[i++];
+
+		if (slab_owns(tlsf, ptr)) {
+			slab_free(tlsf, ptr);
+			continue;
+		}
+
+		block_header_t *block = block_from_ptr(ptr);
+		if (block_is_huge(block)) {
+			huge_free(block);
+			continue;
+		}
+		ASAN_UNPOISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+		ASAN_POISON_MEMORY_REGION(ptr, block_size(block));
+
+		/* Absorb the used blocks that directly follow while it is still used */
+		while (i < count && !slab_owns(tlsf, ptrs[i])
+			&& block_next(block) == block_from_ptr(ptrs[i])) {
+			block_header_t *next = block_from_ptr(ptrs[i++]);
+			ASAN_UNPOISON_MEMORY_REGION(&next->metadata, sizeof(struct metadata));
+			tlsf_assert(!block_is_free(next) && "block already marked as free");
+			ASAN_POISON_MEMORY_REGION(block_to_ptr(next), block_size(next));
+			block_absorb(block, next);
+			ASAN_POISON_MEMORY_REGION(&next->metadata, sizeof(struct metadata));
+		}
+
+		block_release(tlsf, block);
+	}
+}
+
+void tlsf_free_remote(void *ptr)
+{
+	if (ptr != NULL) {
+		remote_push(tlsf_from_ptr(ptr), block_from_ptr(ptr));
+	}
+}
+
+void tlsf_drain_remote(tlsf_t *tlsf)
+{
+	heap_lock(tlsf);
+	remote_drain(tlsf);
+	heap_unlock(tlsf);
+}
+
+/*
+ * The TLSF block information provides us with enough information to
+ * provide a reasonably intelligent implementation of realloc, growing or
+ * shrinking the currently allocated block as required.
+ *
+ * This routine handles the somewhat esoteric edge cases of realloc:
+ * - a non-zero size with a null pointer will behave like malloc
+ * - a zero size with a non-null pointer will behave like free
+ * - a request that cannot be satisfied will leave the original buffer
+ *   untouched
+ * - an extended buffer size will leave the newly-allocated area with
+ *   contents undefined
+ */
+static void *heap_realloc(tlsf_t *tlsf, void *ptr, size_t size)
+{
+	void *p = NULL;
+
+	/* Zero-size requests are treated as free */
+	if (ptr != NULL && size == 0) {
+		heap_free(tlsf, ptr);
+	}
+	/* Requests with NULL pointers are treated as malloc */
+	else if (ptr == NULL) {
+		p = heap_malloc(tlsf, size);
+	}
+	/* Slab objects stay put within their class, otherwise move */
+	else if (slab_owns(tlsf, ptr)) {
+		const size_t cursize = slab_from_ptr(ptr)->size;
+		if (align_up(size, ALIGN_SIZE) == cursize) {
+			p = ptr;
+		} else {
+			p = heap_malloc(tlsf, size);
+			if (p != NULL) {
+				memcpy(p, ptr, tlsf_min(cursize, size));
+				heap_free(tlsf, ptr);
+			}
+		}
+	}
+	/* Huge blocks are remapped, and move back to the pools well below the threshold */
+	else if (block_is_huge(block_from_ptr(ptr))) {
+		remote_drain(tlsf);
+		if (size >= tlsf->huge_threshold / 2) {
+			p = huge_realloc(tlsf, ptr, size);
+		} else {
+			p = heap_malloc(tlsf, size);
+			if (p != NULL) {
+				memcpy(p, ptr, tlsf_min(block_size(block_from_ptr(ptr)), size));
+				heap_free(tlsf, ptr);
+			}
+		}
+	} else {
+		block_header_t *block = block_from_ptr(ptr);
+
+		remote_drain(tlsf);
+
+		ASAN_UNPOISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+		block_header_t *next = block_next(block);
+		ASAN_UNPOISON_MEMORY_REGION(&next->metadata, sizeof(struct metadata));
+
+		const size_t cursize = block_size(block);
+		const size_t combined = cursize + block_size(next) + metadata_size;
+		const size_t adjust = adjust_request_size(size, ALIGN_SIZE);
+
+		tlsf_assert(!block_is_free(block) && "block already marked as free");
+
+		/*
+		 * If the next block is used, or when combined with the current
+		 * block, does not offer enough space, try to grow backward into a
+		 * free previous block. Failing that, we must reallocate and copy.
+		 */
+		if (adjust > cursize && (!block_is_free(next) || adjust > combined)) {
+			const size_t forward = block_is_free(next) ? combined : cursize;
+			size_t backward = 0;
+
+			if (block_is_prev_free(block)) {
+				block_header_t *prev = block_prev(block);
+				ASAN_UNPOISON_MEMORY_REGION(&prev->metadata, sizeof(struct metadata));
+				backward = block_size(prev) + metadata_size;
+				ASAN_POISON_MEMORY_REGION(&prev->metadata, sizeof(struct metadata));
+			}
+			ASAN_POISON_MEMORY_REGION(&next->metadata, sizeof(struct metadata));
+
+			if (backward != 0 && adjust <= forward + backward) {
+				/*
+				 * Take in both neighbours, and move the data down. The last
+				 * word of the data is the trailer of the next block, which
+				 * the merge rewrites, so it is moved separately.
+				 */
+				struct trailer tail;
+				ASAN_UNPOISON_MEMORY_REGION(ptr, cursize);
+				memcpy(&tail, tlsf_cast(char *, ptr) + cursize - trailer_size, trailer_size);
+
+				block_merge_next(tlsf, block);
+				block_merge_prev(tlsf, &block);
+				block_mark_as_used(block);
+
+				p = block_to_ptr(block);
+				ASAN_UNPOISON_MEMORY_REGION(p, block_size(block));
+				memmove(p, ptr, cursize - trailer_size);
+				memcpy(tlsf_cast(char *, p) + cursize - trailer_size, &tail, trailer_size);
+				ASAN_POISON_MEMORY_REGION(tlsf_cast(char *, p) + adjust, block_size(block) - adjust);
+
+				block_trim_used(tlsf, block, adjust);
+				ASAN_POISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+			} else {
+				ASAN_POISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+				p = heap_malloc(tlsf, size);
+				if (p != NULL) {
+					const size_t minsize = tlsf_min(cursize, size);
+					// Unpoison any tail poisoned by an earlier shrink
+					ASAN_UNPOISON_MEMORY_REGION(ptr, cursize);
+					memcpy(p, ptr, minsize);
+					heap_free(tlsf, ptr);
+				}
+			}
+		} else {
+			ASAN_POISON_MEMORY_REGION(&next->metadata, sizeof(struct metadata));
+			/* Do we need to expand to the next block? */
+			if (adjust > cursize) {
+				block_merge_next(tlsf, block);
+				block_mark_as_used(block);
+
+				// Unpoison extra
+				ASAN_UNPOISON_MEMORY_REGION(ptr, adjust);
+			} else {
+				// Poison shrinked
+				ASAN_UNPOISON_MEMORY_REGION(ptr, adjust);
+				ASAN_POISON_MEMORY_REGION(ptr + adjust, cursize - adjust);
+			}
+
+			/* Trim the resulting block and return the original pointer */
+			block_trim_used(tlsf, block, adjust);
+			p = ptr;
+			ASAN_POISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+		}
+	}
+
+	return p;
+}
+
+/*
+ * Public entry points: resolve the heap and take its lock, if any.
+ */
+
+static int heap_slab_enable(tlsf_t *tlsf, size_t bytes)
+{
+	int status = -1;
+
+	if (tlsf->slab_start == NULL) {
+		const size_t arena = align_up(bytes, SLAB_PAGE_SIZE);
+		char *mem = arena ? heap_memalign(tlsf, SLAB_PAGE_SIZE, arena) : NULL;
+
+		if (mem != NULL && region_register(tlsf, mem, mem + arena) == 0) {
+			tlsf->slab_start = tlsf->slab_bump = mem;
+			tlsf->slab_end = mem + arena;
+			status = 0;
+		} else if (mem != NULL) {
+			heap_free(tlsf, mem);
+		}
+	}
+	return status;
+}
+
+int tlsf_slab_enable(tlsf_t *tlsf, size_t bytes)
+{
+	heap_lock(tlsf);
+	const int status = heap_slab_enable(tlsf, bytes);
+	heap_unlock(tlsf);
+
+	return status;
+}
+
+void tlsf_reset(tlsf_t *tlsf)
+{
+	heap_lock(tlsf);
+	const size_t slab_bytes = tlsf_cast(size_t, tlsf->slab_end - tlsf->slab_start);
+
+	if (tlsf->slab_start != NULL) {
+		region_unregister(tlsf->slab_start, tlsf->slab_end);
+	}
+	heap_reset(tlsf);
+
+	/* Carve a new slab arena of the same size out of the empty pools */
+	if (slab_bytes != 0) {
+		heap_slab_enable(tlsf, slab_bytes);
+	}
+	heap_unlock(tlsf);
+}
+
+void *tlsf_malloc(tlsf_t *tlsf, size_t size)
+{
+	heap_lock(tlsf);
+	void *p = heap_malloc(tlsf, size);
+	heap_unlock(tlsf);
+	return p;
+}
+
+void *tlsf_calloc(tlsf_t *tlsf, size_t count, size_t size)
+{
+	heap_lock(tlsf);
+	void *p = heap_calloc(tlsf, count, size);
+	heap_unlock(tlsf);
+	return p;
+}
+
+void *tlsf_memalign(tlsf_t *tlsf, size_t align, size_t size)
+{
+	heap_lock(tlsf);
+	void *p = heap_memalign(tlsf, align, size);
+	heap_unlock(tlsf);
+	return p;
+}
+
+void tlsf_free(tlsf_t *tlsf, void *ptr)
+{
+	/* Don't attempt to free a NULL pointer */
+	if (ptr != NULL) {
+		tlsf_t *owner = tlsf_from_ptr(ptr);
+
+		if (tlsf == NULL) {
+			tlsf = owner;
+		} else if (tlsf != owner) {
+			/* Freed on behalf of another heap: leave it to its owner */
+			remote_push(owner, block_from_ptr(ptr));
+			return;
+		}
+
+		heap_lock(tlsf);
+		heap_free(tlsf, ptr);
+		heap_unlock(tlsf);
+	}
+}
+
+size_t tlsf_malloc_batch(tlsf_t *tlsf, size_t size, size_t count, void **ptrs)
+{
+	heap_lock(tlsf);
+	const size_t done = heap_malloc_batch(tlsf, size, count, ptrs);
+	heap_unlock(tlsf);
+	return done;
+}
+
+void tlsf_free_batch(tlsf_t *tlsf, void **ptrs, size_t count)
+{
+	size_t i, kept = 0;
+
+	/* Hand NULL and foreign pointers off first, as tlsf_free does */
+	for (i = 0; i < count; i++) {
+		void *ptr = ptrs[i];
+		if (ptr == NULL) {
+			continue;
+		}
+		tlsf_t *owner = tlsf_from_ptr(ptr);
+		if (tlsf == NULL) {
+			tlsf = owner;
+		}
+		if (owner != tlsf) {
+			remote_push(owner, block_from_ptr(ptr));
+		} else {
+			ptrs[kept++] = ptr;
+		}
+	}
+
+	if (kept > 0) {
+		heap_lock(tlsf);
+		heap_free_batch(tlsf, ptrs, kept);
+		heap_unlock(tlsf);
+	}
+}
+
+void *tlsf_realloc(tlsf_t *tlsf, void *ptr, size_t size)
+{
+	void *p = NULL;
+
+	if (ptr == NULL) {
+		tlsf_assert(tlsf != NULL && "realloc with NULL pointer requires heap argument");
+	} else if (tlsf == NULL) {
+		tlsf = tlsf_from_ptr(ptr);
+	} else if (tlsf != tlsf_from_ptr(ptr)) {
+		/* Blocks of another heap are moved into this one */
+		if (size == 0) {
+			tlsf_free_remote(ptr);
+			return NULL;
+		}
+		p = tlsf_malloc(tlsf, size);
+		if (p != NULL) {
+			memcpy(p, ptr, tlsf_min(tlsf_block_size(ptr), size));
+			tlsf_free_remote(ptr);
+		}
+		return p;
+	}
+
+	heap_lock(tlsf);
+	p = heap_realloc(tlsf, ptr, size);
+	heap_unlock(tlsf);
+	return p;
+}
+
+/*
+ * Thread caches.
+ *
+ * A thread cache keeps a magazine of used blocks (or slab objects) per
+ * small size class, so that most allocations and frees of a thread never
+ * enter the heap and never take the lock that guards it. The heap is only
+ * entered on a miss, to move half a magazine in or out at once.
+ */
+
+enum tlsf_cache_private {
+	CACHE_CLASS_COUNT = CACHE_FL_COUNT * SL_INDEX_COUNT,
+	CACHE_BATCH = CACHE_MAGAZINE_SIZE / 2,
+};
+
+typedef struct magazine {
+	unsigned int count;
+	void *slots[CACHE_MAGAZINE_SIZE];
+} magazine_t;
+
+struct tlsf_cache {
+	tlsf_t *tlsf;
+
+	/* Serialize access to the heap on a miss, may be NULL */
+	tlsf_lock_fn lock;
+	tlsf_lock_fn unlock;
+	void *user;
+
+	magazine_t magazines[CACHE_CLASS_COUNT];
+};
+
+/*
+ * Size of a block owned by this thread. Address sanitizer is disabled as
+ * in tlsf_from_ptr: the heap may update the flag bits of this header
+ * under its lock while the cache reads the size bits without it.
+ */
+ASAN_NO_SANITIZE_ADDRESS
+static size_t cache_block_size(const tlsf_cache_t *cache, const void *ptr)
+{
+	if (slab_owns(cache->tlsf, ptr)) {
+		return slab_from_ptr(ptr)->size;
+	}
+	const block_header_t *block = block_from_ptr(ptr);
+	return block->metadata.size & ~(block_header_free_bit | block_header_prev_free_bit
+		| block_header_purged_bit);
+}
+
+static void cache_lock(tlsf_cache_t *cache)
+{
+	if (cache->lock != NULL) {
+		cache->lock(cache->user);
+	}
+	heap_lock(cache->tlsf);
+}
+
+static void cache_unlock(tlsf_cache_t *cache)
+{
+	heap_unlock(cache->tlsf);
+	if (cache->unlock != NULL) {
+		cache->unlock(cache->user);
+	}
+}
+
+/* Move up to CACHE_BATCH new blocks of a class from the heap */
+static void cache_refill(tlsf_cache_t *cache, magazine_t *mag, size_t size)
+{
+	const size_t want = CACHE_BATCH - tlsf_min(mag->count, CACHE_BATCH);
+	size_t i;
+
+	cache_lock(cache);
+	const size_t got = heap_malloc_batch(cache->tlsf, size, want, mag->slots + mag->count);
+	cache_unlock(cache);
+
+	for (i = 0; i < got; i++) {
+		void *ptr = mag->slots[mag->count++];
+		ASAN_POISON_MEMORY_REGION(ptr, cache_block_size(cache, ptr));
+	}
+}
+
+/* Return the oldest count blocks of a magazine to the heap */
+static void cache_drain(tlsf_cache_t *cache, magazine_t *mag, unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		void *ptr = mag->slots[i];
+		ASAN_UNPOISON_MEMORY_REGION(ptr, cache_block_size(cache, ptr));
+	}
+
+	cache_lock(cache);
+	heap_free_batch(cache->tlsf, mag->slots, count);
+	cache_unlock(cache);
+
+	mag->count -= count;
+	memmove(mag->slots, mag->slots + count, mag->count * sizeof(void *));
+}
+
+size_t tlsf_cache_size(void)
+{
+	return sizeof(tlsf_cache_t);
+}
+
+tlsf_cache_t *tlsf_cache_create(void *mem, tlsf_t *tlsf,
+	tlsf_lock_fn lock, tlsf_lock_fn unlock, void *user)
+{
+	tlsf_cache_t *cache = tlsf_cast(tlsf_cache_t *, mem);
+	int i;
+
+	if (((ptrdiff_t)mem % ALIGN_SIZE) != 0) {
+		printf("tlsf_cache_create: Memory must be aligned to %u bytes.\n",
+			(unsigned int)ALIGN_SIZE);
+		return NULL;
+	}
+
+	cache->tlsf = tlsf;
+	cache->lock = lock;
+	cache->unlock = unlock;
+	cache->user = user;
+	for (i = 0; i < CACHE_CLASS_COUNT; i++) {
+		cache->magazines[i].count = 0;
+	}
 
-	/* Split the block to create a zero-size sentinel block */
-	next = block_next(block);
-	block_link_next(block);
-	block_set_size(next, 0);
-	block_set_used(next);
-	block_set_prev_free(next);
-	next->metadata.tlsf = tlsf;
+	return cache;
+}
+
+void tlsf_cache_destroy(tlsf_cache_t *cache)
+{
+	tlsf_cache_flush(cache);
+}
+
+void tlsf_cache_flush(tlsf_cache_t *cache)
+{
+	int i;
+
+	for (i = 0; i < CACHE_CLASS_COUNT; i++) {
+		magazine_t *mag = &cache->magazines[i];
+		if (mag->count > 0) {
+			cache_drain(cache, mag, mag->count);
+		}
+	}
+}
+
+void *tlsf_cache_malloc(tlsf_cache_t *cache, size_t size)
+{
+	const size_t adjust = adjust_request_size(size, ALIGN_SIZE);
+	int fl = 0;
+	int sl = 0;
+	void *p;
 
-	ASAN_POISON_MEMORY_REGION(block_to_ptr(block), block_size(block));
-	ASAN_POISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
-	ASAN_POISON_MEMORY_REGION(&next->metadata, sizeof(struct metadata));
+	if (adjust > 0) {
+		mapping_search(mapping_round(adjust), &fl, &sl);
+	}
 
-	return mem;
+	if (adjust == 0 || fl >= CACHE_FL_COUNT) {
+		/* Not a cached class, go straight to the heap */
+		cache_lock(cache);
+		p = heap_malloc(cache->tlsf, size);
+		cache_unlock(cache);
+		return p;
+	}
+
+	magazine_t *mag = &cache->magazines[fl * SL_INDEX_COUNT + sl];
+	if (mag->count == 0) {
+		/* Refill with blocks of the class size so any of them fits */
+		cache_refill(cache, mag, mapping_size(fl, sl));
+		if (mag->count == 0) {
+			return NULL;
+		}
+	}
+
+	p = mag->slots[--mag->count];
+	ASAN_UNPOISON_MEMORY_REGION(p, cache_block_size(cache, p));
+	return p;
 }
 
-void tlsf_remove_pool(tlsf_t *tlsf, tlsf_pool_t *pool)
+void tlsf_cache_free(tlsf_cache_t *cache, void *ptr)
 {
-	block_header_t *block = first_block(pool);
-	ASAN_UNPOISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
-	block_header_t *next = block_next(block);
-	ASAN_UNPOISON_MEMORY_REGION(&next->metadata, sizeof(struct metadata));
+	if (ptr == NULL) {
+		return;
+	}
 
-	int fl = 0;
-	int sl = 0;
+	const size_t size = cache_block_size(cache, ptr);
+	int fl, sl;
 
-	tlsf_assert(block_is_free(block) && "block should be free");
-	tlsf_assert(!block_is_free(next) && "next block should not be free");
-	tlsf_assert(block_size(next) == 0 && "next block size should be zero");
+	if (!slab_owns(cache->tlsf, ptr) && tlsf_from_ptr(ptr) != cache->tlsf) {
+		tlsf_free_remote(ptr);
+		return;
+	}
 
-	mapping_search(block_size(block), &fl, &sl);
-	remove_free_block(tlsf, block, fl, sl);
+	/* The block goes to the largest class it can satisfy */
+	mapping_search(size, &fl, &sl);
+	if (fl >= CACHE_FL_COUNT) {
+		cache_lock(cache);
+		heap_free(cache->tlsf, ptr);
+		cache_unlock(cache);
+		return;
+	}
 
-	ASAN_UNPOISON_MEMORY_REGION(block_to_ptr(block), block_size(block));
+	magazine_t *mag = &cache->magazines[fl * SL_INDEX_COUNT + sl];
+	if (mag->count == CACHE_MAGAZINE_SIZE) {
+		cache_drain(cache, mag, CACHE_BATCH);
+	}
+
+	ASAN_POISON_MEMORY_REGION(ptr, size);
+	mag->slots[mag->count++] = ptr;
 }
 
 /*
- * TLSF main interface.
+ * Sharded heaps.
+ *
+ * A sharded heap owns a number of independent locked heaps, laid out
+ * after its header in the control memory. Requests go to the shard of
+ * the current CPU, or to a shard assigned to the calling thread, and
+ * move on to the neighbouring shards when that one is exhausted. Frees
+ * go to the owning shard, found through the block header.
  */
 
-#if _DEBUG
-int test_ffs_fls()
-{
-	/* Verify ffs/fls work properly */
-	int rv = 0;
-	rv += (tlsf_ffs(0) == -1) ? 0 : 0x1;
-	rv += (tlsf_fls(0) == -1) ? 0 : 0x2;
-	rv += (tlsf_ffs(1) == 0) ? 0 : 0x4;
-	rv += (tlsf_fls(1) == 0) ? 0 : 0x8;
-	rv += (tlsf_ffs(0x80000000) == 31) ? 0 : 0x10;
-	rv += (tlsf_ffs(0x80008000) == 15) ? 0 : 0x20;
-	rv += (tlsf_fls(0x80000008) == 31) ? 0 : 0x40;
-	rv += (tlsf_fls(0x7FFFFFFF) == 30) ? 0 : 0x80;
+struct tlsf_sharded {
+	int count;
+	int policy;
+};
 
-#if defined (TLSF_64BIT)
-	rv += (tlsf_fls_sizet(0x80000000) == 31) ? 0 : 0x100;
-	rv += (tlsf_fls_sizet(0x100000000) == 32) ? 0 : 0x200;
-	rv += (tlsf_fls_sizet(0xffffffffffffffff) == 63) ? 0 : 0x400;
-#endif
+static const size_t sharded_header_size =
+	(sizeof(struct tlsf_sharded) + ALIGN_SIZE - 1) & ~(tlsf_cast(size_t, ALIGN_SIZE) - 1);
 
-	if (rv) {
-		printf("test_ffs_fls: %x ffs/fls tests failed.\n", rv);
-	}
-	return rv;
-}
+/* Pools of different shards must not share a granule, see region_register */
+#if TLSF_COMPACT_HEADER
+static const size_t shard_pool_align = REGION_GRANULE;
+#else
+static const size_t shard_pool_align = ALIGN_SIZE;
 #endif
 
-tlsf_t *tlsf_create(void *mem)
+/* Round robin shard assignment for TLSF_SHARD_BY_THREAD */
+static atomic_uint sharded_next_thread;
+static __thread int sharded_thread = -1;
+
+static int sharded_current(const tlsf_sharded_t *sharded)
 {
-#if _DEBUG
-	if (test_ffs_fls()) {
-		return NULL;
+	int index = -1;
+
+#if HAVE_SCHED_GETCPU
+	if (sharded->policy == TLSF_SHARD_BY_CPU) {
+		index = sched_getcpu();
 	}
 #endif
+	if (index < 0) {
+		if (sharded_thread < 0) {
+			sharded_thread = tlsf_cast(int,
+				atomic_fetch_add_explicit(&sharded_next_thread, 1, memory_order_relaxed) & INT_MAX);
+		}
+		index = sharded_thread;
+	}
+
+	return index % sharded->count;
+}
+
+size_t tlsf_sharded_size(int count)
+{
+	return sharded_header_size + tlsf_cast(size_t, count) * tlsf_size();
+}
+
+tlsf_t *tlsf_sharded_heap(tlsf_sharded_t *sharded, int index)
+{
+	tlsf_assert(index >= 0 && index < sharded->count && "invalid shard index");
+	return tlsf_cast(tlsf_t *, tlsf_cast(char *, sharded) + sharded_header_size
+		+ tlsf_cast(size_t, index) * tlsf_size());
+}
+
+int tlsf_sharded_count(tlsf_sharded_t *sharded)
+{
+	return sharded->count;
+}
+
+tlsf_sharded_t *tlsf_sharded_create(void *mem, int count, int policy)
+{
+	tlsf_sharded_t *sharded = tlsf_cast(tlsf_sharded_t *, mem);
+	int i;
 
 	if (((ptrdiff_t)mem % ALIGN_SIZE) != 0) {
-		printf("tlsf_create: Memory must be aligned to %u bytes.\n",
+		printf("tlsf_sharded_create: Memory must be aligned to %u bytes.\n",
 			(unsigned int)ALIGN_SIZE);
 		return NULL;
 	}
 
-	control_construct(tlsf_cast(tlsf_t *, mem));
+	if (count <= 0) {
+		printf("tlsf_sharded_create: Shard count must be positive.\n");
+		return NULL;
+	}
 
-	return tlsf_cast(tlsf_t *, mem);
+	sharded->count = count;
+	sharded->policy = policy;
+	for (i = 0; i < count; i++) {
+		tlsf_create_locked(tlsf_sharded_heap(sharded, i));
+	}
+
+	return sharded;
 }
 
-tlsf_t *tlsf_create_with_pool(void *mem, size_t bytes)
+tlsf_sharded_t *tlsf_sharded_create_with_pool(void *mem, size_t bytes, int count, int policy)
 {
-	tlsf_t *tlsf = tlsf_create(mem);
-	tlsf_add_pool(tlsf, (char *)mem + tlsf_size(), bytes - tlsf_size());
-	return tlsf;
+	tlsf_sharded_t *sharded;
+	int i;
+
+	if (count > 0 && bytes <= tlsf_sharded_size(count)) {
+		printf("tlsf_sharded_create_with_pool: Memory size must exceed %zu bytes.\n",
+			tlsf_sharded_size(count));
+		return NULL;
+	}
+
+	sharded = tlsf_sharded_create(mem, count, policy);
+	if (sharded != NULL) {
+		char *pool = align_ptr(tlsf_cast(char *, mem) + tlsf_sharded_size(count), shard_pool_align);
+		const size_t control = tlsf_cast(size_t, pool - tlsf_cast(char *, mem));
+		const size_t shard_bytes = control < bytes ?
+			align_down((bytes - control) / count, shard_pool_align) : 0;
+
+		for (i = 0; i < count; i++, pool += shard_bytes) {
+			tlsf_add_pool(tlsf_sharded_heap(sharded, i), pool, shard_bytes);
+		}
+	}
+
+	return sharded;
 }
 
-void tlsf_destroy(tlsf_t *tlsf)
+void tlsf_sharded_destroy(tlsf_sharded_t *sharded)
 {
-	ASAN_UNPOISON_MEMORY_REGION(&tlsf->block_null.free_list, sizeof(struct free_list));
+	int i;
 
-	/* Nothing to do */
-	(void)tlsf;
+	for (i = 0; i < sharded->count; i++) {
+		tlsf_destroy(tlsf_sharded_heap(sharded, i));
+	}
 }
 
-tlsf_pool_t *tlsf_get_pool(tlsf_t *tlsf)
+void *tlsf_sharded_malloc(tlsf_sharded_t *sharded, size_t size)
 {
-	return tlsf_cast(tlsf_pool_t *, (char *)tlsf + tlsf_size());
+	const int start = sharded_current(sharded);
+	void *p = NULL;
+	int i;
+
+	for (i = 0; p == NULL && i < sharded->count; i++) {
+		p = tlsf_malloc(tlsf_sharded_heap(sharded, (start + i) % sharded->count), size);
+	}
+
+	return p;
 }
 
-void *tlsf_malloc(tlsf_t *tlsf, size_t size)
+void *tlsf_sharded_memalign(tlsf_sharded_t *sharded, size_t align, size_t size)
 {
-	const size_t adjust = adjust_request_size(size, ALIGN_SIZE);
-	block_header_t *block = block_locate_free(tlsf, adjust);
-	return block_prepare_used(tlsf, block, adjust);
+	const int start = sharded_current(sharded);
+	void *p = NULL;
+	int i;
+
+	for (i = 0; p == NULL && i < sharded->count; i++) {
+		p = tlsf_memalign(tlsf_sharded_heap(sharded, (start + i) % sharded->count), align, size);
+	}
+
+	return p;
 }
 
-void *tlsf_memalign(tlsf_t *tlsf, size_t align, size_t size)
+void *tlsf_sharded_realloc(tlsf_sharded_t *sharded, void *ptr, size_t size)
 {
-	const size_t adjust = adjust_request_size(size, ALIGN_SIZE);
+	void *p;
 
-	/*
-	 * We must allocate an additional minimum block size bytes so that if
-	 * our free block will leave an alignment gap which is smaller, we can
-	 * trim a leading free block and release it back to the pool. We must
-	 * do this because the previous physical block is in use, therefore
-	 * the prev_phys_block field is not valid, and we can't simply adjust
-	 * the size of that block.
-	 */
-	const size_t gap_minimum = sizeof(block_header_t);
-	const size_t size_with_gap = adjust_request_size(adjust + align + gap_minimum, align);
+	if (ptr == NULL) {
+		return tlsf_sharded_malloc(sharded, size);
+	}
 
-	/*
-	 * If alignment is less than or equals base alignment, we're done.
-	 * If we requested 0 bytes, return null, as tlsf_malloc(0) does.
-	 */
-	const size_t aligned_size = (adjust && align > ALIGN_SIZE) ? size_with_gap : adjust;
+	/* Grow or shrink within the owning shard first */
+	p = tlsf_realloc(tlsf_from_ptr(ptr), ptr, size);
+	if (p == NULL && size > 0) {
+		p = tlsf_sharded_malloc(sharded, size);
+		if (p != NULL) {
+			memcpy(p, ptr, tlsf_min(tlsf_block_size(ptr), size));
+			tlsf_free(NULL, ptr);
+		}
+	}
 
-	block_header_t *block = block_locate_free(tlsf, aligned_size);
+	return p;
+}
 
-	/* This can't be a static assert */
-	tlsf_assert(sizeof(block_header_t) == block_size_min + metadata_size);
+void tlsf_sharded_free(tlsf_sharded_t *sharded, void *ptr)
+{
+	(void)sharded;
+	tlsf_free(NULL, ptr);
+}
 
-	if (block != NULL) {
-		void *ptr = block_to_ptr(block);
-		void *aligned = align_ptr(ptr, align);
-		size_t gap = tlsf_cast(size_t,
-			tlsf_cast(ptrdiff_t, aligned) - tlsf_cast(ptrdiff_t, ptr));
+/*
+ * Bump-pointer arenas.
+ *
+ * An arena takes chunks from its heap with tlsf_malloc and serves requests
+ * by moving a pointer through the current chunk, so objects carry no
+ * header and are never split from or merged into the free lists. A full
+ * chunk stays chained behind the next one. Chunks go back to the heap when
+ * the arena is rewound past them, or destroyed.
+ */
 
-		/* If gap size is too small, offset to next aligned boundary */
-		if (gap > 0 && gap < gap_minimum) {
-			const size_t gap_remain = gap_minimum - gap;
-			const size_t offset = tlsf_max(gap_remain, align);
-			const void *next_aligned = tlsf_cast(void *,
-				tlsf_cast(ptrdiff_t, aligned) + offset);
+typedef struct arena_chunk {
+	struct arena_chunk *prev;
+	char *end;
+} arena_chunk_t;
 
-			aligned = align_ptr(next_aligned, align);
-			gap = tlsf_cast(size_t,
-				tlsf_cast(ptrdiff_t, aligned) - tlsf_cast(ptrdiff_t, ptr));
-		}
+struct tlsf_arena {
+	tlsf_t *tlsf;
+	size_t chunk_bytes;
 
-		if (gap > 0) {
-			tlsf_assert(gap >= gap_minimum && "gap size too small");
-			block_trim_free_leading(tlsf, &block, gap);
-		}
+	/* Newest chunk, and the unused room at its end */
+	arena_chunk_t *chunk;
+	char *bump;
+	char *end;
+};
+
+static const size_t arena_chunk_header_size =
+	(sizeof(arena_chunk_t) + ALIGN_SIZE - 1) & ~(tlsf_cast(size_t, ALIGN_SIZE) - 1);
+
+/* Chain a chunk with room for size bytes aligned to align */
+static int arena_grow(tlsf_arena_t *arena, size_t align, size_t size)
+{
+	const size_t gap = align > ALIGN_SIZE ? align - ALIGN_SIZE : 0;
+	arena_chunk_t *chunk;
+
+	if (size > block_size_max - arena_chunk_header_size - gap) {
+		return -1;
 	}
+	const size_t bytes = tlsf_max(arena->chunk_bytes, arena_chunk_header_size + gap + size);
 
-	return block_prepare_used(tlsf, block, adjust);
+	chunk = tlsf_cast(arena_chunk_t *, tlsf_malloc(arena->tlsf, bytes));
+	if (chunk == NULL) {
+		return -1;
+	}
+
+	chunk->prev = arena->chunk;
+	chunk->end = tlsf_cast(char *, chunk) + bytes;
+	arena->chunk = chunk;
+	arena->bump = tlsf_cast(char *, chunk) + arena_chunk_header_size;
+	arena->end = chunk->end;
+	ASAN_POISON_MEMORY_REGION(arena->bump, tlsf_cast(size_t, arena->end - arena->bump));
+	return 0;
 }
 
-void tlsf_free(tlsf_t *tlsf, void *ptr)
+/* Return the newest chunk to the heap */
+static void arena_drop(tlsf_arena_t *arena)
 {
-	/* Don't attempt to free a NULL pointer */
-	if (ptr != NULL) {
-		block_header_t *block = block_from_ptr(ptr);
-		ASAN_UNPOISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
-		ASAN_POISON_MEMORY_REGION(ptr, block_size(block));
-		tlsf_assert(!block_is_free(block) && "block already marked as free");
-		block_mark_as_free(block);
+	arena_chunk_t *chunk = arena->chunk;
 
-		if (tlsf == NULL) {
-			tlsf = block->metadata.tlsf;
-		} else {
-			assert(tlsf == block->metadata.tlsf && "invalid heap");
-		}
+	arena->chunk = chunk->prev;
+	arena->bump = arena->end = NULL;
+	ASAN_UNPOISON_MEMORY_REGION(chunk, tlsf_cast(size_t, chunk->end - tlsf_cast(char *, chunk)));
+	tlsf_free(arena->tlsf, chunk);
+}
 
-		block_merge_prev(tlsf, &block);
-		block_merge_next(tlsf, block);
-		block_insert(tlsf, block);
-		ASAN_POISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
-		// ASAN poison data block
-	}
+size_t tlsf_arena_size(void)
+{
+	return sizeof(tlsf_arena_t);
 }
 
-/*
- * The TLSF block information provides us with enough information to
- * provide a reasonably intelligent implementation of realloc, growing or
- * shrinking the currently allocated block as required.
- *
- * This routine handles the somewhat esoteric edge cases of realloc:
- * - a non-zero size with a null pointer will behave like malloc
- * - a zero size with a non-null pointer will behave like free
- * - a request that cannot be satisfied will leave the original buffer
- *   untouched
- * - an extended buffer size will leave the newly-allocated area with
- *   contents undefined
- */
-void *tlsf_realloc(tlsf_t *tlsf, void *ptr, size_t size)
+tlsf_arena_t *tlsf_arena_create(void *mem, tlsf_t *tlsf, size_t chunk_bytes)
 {
-	void *p = NULL;
+	tlsf_arena_t *arena = tlsf_cast(tlsf_arena_t *, mem);
 
-	/* Zero-size requests are treated as free */
-	if (ptr != NULL && size == 0) {
-		tlsf_free(tlsf, ptr);
+	if (((ptrdiff_t)mem % ALIGN_SIZE) != 0) {
+		printf("tlsf_arena_create: Memory must be aligned to %u bytes.\n",
+			(unsigned int)ALIGN_SIZE);
+		return NULL;
 	}
-	/* Requests with NULL pointers are treated as malloc */
-	else if (ptr == NULL) {
-		tlsf_assert(tlsf != NULL && "realloc with NULL pointer requires heap argument");
-		p = tlsf_malloc(tlsf, size);
-	} else {
-		block_header_t *block = block_from_ptr(ptr);
-		ASAN_UNPOISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
-		block_header_t *next = block_next(block);
-		ASAN_UNPOISON_MEMORY_REGION(&next->metadata, sizeof(struct metadata));
 
-		const size_t cursize = block_size(block);
-		const size_t combined = cursize + block_size(next) + metadata_size;
-		const size_t adjust = adjust_request_size(size, ALIGN_SIZE);
+	if (chunk_bytes < arena_chunk_header_size + ALIGN_SIZE || chunk_bytes > block_size_max) {
+		printf("tlsf_arena_create: Chunk size must be between %zu and %zu bytes.\n",
+			arena_chunk_header_size + ALIGN_SIZE, block_size_max);
+		return NULL;
+	}
 
-		if (tlsf == NULL) {
-			tlsf = block->metadata.tlsf;
-		} else {
-			tlsf_assert(tlsf == block->metadata.tlsf && "invalid heap");
-		}
+	arena->tlsf = tlsf;
+	arena->chunk_bytes = align_down(chunk_bytes, ALIGN_SIZE);
+	arena->chunk = NULL;
+	arena->bump = arena->end = NULL;
 
-		tlsf_assert(!block_is_free(block) && "block already marked as free");
+	return arena;
+}
 
-		/*
-		 * If the next block is used, or when combined with the current
-		 * block, does not offer enough space, we must reallocate and copy.
-		 */
-		if (adjust > cursize && (!block_is_free(next) || adjust > combined)) {
+void tlsf_arena_destroy(tlsf_arena_t *arena)
+{
+	while (arena->chunk != NULL) {
+		arena_drop(arena);
+	}
+}
 
-			ASAN_POISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
-			ASAN_POISON_MEMORY_REGION(&next->metadata, sizeof(struct metadata));
-			p = tlsf_malloc(tlsf, size);
-			if (p != NULL) {
-				const size_t minsize = tlsf_min(cursize, size);
-				memcpy(p, ptr, minsize);
-				tlsf_free(tlsf, ptr);
-			}
-		} else {
-			ASAN_POISON_MEMORY_REGION(&next->metadata, sizeof(struct metadata));
-			/* Do we need to expand to the next block? */
-			if (adjust > cursize) {
-				block_merge_next(tlsf, block);
-				block_mark_as_used(block);
+void *tlsf_arena_memalign(tlsf_arena_t *arena, size_t align, size_t size)
+{
+	char *p;
 
-				// Unpoison extra
-				ASAN_UNPOISON_MEMORY_REGION(ptr + cursize, adjust - cursize);
-			} else {
-				// Poison shrinked
-				ASAN_POISON_MEMORY_REGION(ptr + adjust, cursize - adjust);
-			}
+	tlsf_assert(0 == (align & (align - 1)) && "must align to a power of two");
+	if (size == 0 || size > block_size_max) {
+		return NULL;
+	}
+	size = align_up(size, ALIGN_SIZE);
+	align = tlsf_max(align, ALIGN_SIZE);
 
-			/* Trim the resulting block and return the original pointer */
-			block_trim_used(tlsf, block, adjust);
-			p = ptr;
-			ASAN_POISON_MEMORY_REGION(&block->metadata, sizeof(struct metadata));
+	p = align_ptr(arena->bump, align);
+	if (arena->chunk == NULL || p > arena->end || size > tlsf_cast(size_t, arena->end - p)) {
+		if (arena_grow(arena, align, size) != 0) {
+			return NULL;
 		}
+		p = align_ptr(arena->bump, align);
 	}
 
+	arena->bump = p + size;
+	ASAN_UNPOISON_MEMORY_REGION(p, size);
 	return p;
 }
+
+void *tlsf_arena_malloc(tlsf_arena_t *arena, size_t size)
+{
+	return tlsf_arena_memalign(arena, ALIGN_SIZE, size);
+}
+
+void tlsf_arena_mark(tlsf_arena_t *arena, tlsf_arena_mark_t *mark)
+{
+	mark->chunk = arena->chunk;
+	mark->bump = arena->bump;
+}
+
+void tlsf_arena_rewind(tlsf_arena_t *arena, const tlsf_arena_mark_t *mark)
+{
+	arena_chunk_t *chunk = tlsf_cast(arena_chunk_t *, mark->chunk);
+
+	/* Chunks chained after the mark go back to the heap */
+	while (arena->chunk != chunk) {
+		tlsf_assert(arena->chunk && "mark does not belong to this arena");
+		arena_drop(arena);
+	}
+
+	if (chunk != NULL) {
+		arena->bump = mark->bump;
+		arena->end = chunk->end;
+		ASAN_POISON_MEMORY_REGION(arena->bump, tlsf_cast(size_t, arena->end - arena->bump));
+	}
+}
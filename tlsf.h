@@ -41,6 +41,87 @@
 
 #include <stddef.h>
 
+/*
+ * Builds with a TLSF_PREFIX, e.g. -DTLSF_PREFIX=sl6_, export their entry
+ * points as sl6_tlsf_malloc and so on, so that several configurations can
+ * be linked into one program. See tlsf_get_variant.
+ */
+#if defined (TLSF_PREFIX)
+#define TLSF_PASTE_(a, b) a##b
+#define TLSF_PASTE(a, b) TLSF_PASTE_(a, b)
+#define tlsf_add_pool TLSF_PASTE(TLSF_PREFIX, tlsf_add_pool)
+#define tlsf_add_pool_zeroed TLSF_PASTE(TLSF_PREFIX, tlsf_add_pool_zeroed)
+#define tlsf_align_size TLSF_PASTE(TLSF_PREFIX, tlsf_align_size)
+#define tlsf_alloc_overhead TLSF_PASTE(TLSF_PREFIX, tlsf_alloc_overhead)
+#define tlsf_arena_create TLSF_PASTE(TLSF_PREFIX, tlsf_arena_create)
+#define tlsf_arena_destroy TLSF_PASTE(TLSF_PREFIX, tlsf_arena_destroy)
+#define tlsf_arena_malloc TLSF_PASTE(TLSF_PREFIX, tlsf_arena_malloc)
+#define tlsf_arena_mark TLSF_PASTE(TLSF_PREFIX, tlsf_arena_mark)
+#define tlsf_arena_memalign TLSF_PASTE(TLSF_PREFIX, tlsf_arena_memalign)
+#define tlsf_arena_rewind TLSF_PASTE(TLSF_PREFIX, tlsf_arena_rewind)
+#define tlsf_arena_size TLSF_PASTE(TLSF_PREFIX, tlsf_arena_size)
+#define tlsf_block_size TLSF_PASTE(TLSF_PREFIX, tlsf_block_size)
+#define tlsf_block_size_max TLSF_PASTE(TLSF_PREFIX, tlsf_block_size_max)
+#define tlsf_block_size_min TLSF_PASTE(TLSF_PREFIX, tlsf_block_size_min)
+#define tlsf_cache_create TLSF_PASTE(TLSF_PREFIX, tlsf_cache_create)
+#define tlsf_cache_destroy TLSF_PASTE(TLSF_PREFIX, tlsf_cache_destroy)
+#define tlsf_cache_flush TLSF_PASTE(TLSF_PREFIX, tlsf_cache_flush)
+#define tlsf_cache_free TLSF_PASTE(TLSF_PREFIX, tlsf_cache_free)
+#define tlsf_cache_malloc TLSF_PASTE(TLSF_PREFIX, tlsf_cache_malloc)
+#define tlsf_cache_size TLSF_PASTE(TLSF_PREFIX, tlsf_cache_size)
+#define tlsf_calloc TLSF_PASTE(TLSF_PREFIX, tlsf_calloc)
+#define tlsf_census TLSF_PASTE(TLSF_PREFIX, tlsf_census)
+#define tlsf_census_size TLSF_PASTE(TLSF_PREFIX, tlsf_census_size)
+#define tlsf_check TLSF_PASTE(TLSF_PREFIX, tlsf_check)
+#define tlsf_check_pool TLSF_PASTE(TLSF_PREFIX, tlsf_check_pool)
+#define tlsf_create TLSF_PASTE(TLSF_PREFIX, tlsf_create)
+#define tlsf_create_locked TLSF_PASTE(TLSF_PREFIX, tlsf_create_locked)
+#define tlsf_create_with_pool TLSF_PASTE(TLSF_PREFIX, tlsf_create_with_pool)
+#define tlsf_create_with_pool_locked TLSF_PASTE(TLSF_PREFIX, tlsf_create_with_pool_locked)
+#define tlsf_destroy TLSF_PASTE(TLSF_PREFIX, tlsf_destroy)
+#define tlsf_drain_remote TLSF_PASTE(TLSF_PREFIX, tlsf_drain_remote)
+#define tlsf_free TLSF_PASTE(TLSF_PREFIX, tlsf_free)
+#define tlsf_free_batch TLSF_PASTE(TLSF_PREFIX, tlsf_free_batch)
+#define tlsf_free_remote TLSF_PASTE(TLSF_PREFIX, tlsf_free_remote)
+#define tlsf_from_ptr TLSF_PASTE(TLSF_PREFIX, tlsf_from_ptr)
+#define tlsf_get_lock_stats TLSF_PASTE(TLSF_PREFIX, tlsf_get_lock_stats)
+#define tlsf_get_pool TLSF_PASTE(TLSF_PREFIX, tlsf_get_pool)
+#define tlsf_get_stats TLSF_PASTE(TLSF_PREFIX, tlsf_get_stats)
+#define tlsf_get_variant TLSF_PASTE(TLSF_PREFIX, tlsf_get_variant)
+#define tlsf_largest_allocatable TLSF_PASTE(TLSF_PREFIX, tlsf_largest_allocatable)
+#define tlsf_malloc TLSF_PASTE(TLSF_PREFIX, tlsf_malloc)
+#define tlsf_malloc_batch TLSF_PASTE(TLSF_PREFIX, tlsf_malloc_batch)
+#define tlsf_map_pool TLSF_PASTE(TLSF_PREFIX, tlsf_map_pool)
+#define tlsf_memalign TLSF_PASTE(TLSF_PREFIX, tlsf_memalign)
+#define tlsf_pool_overhead TLSF_PASTE(TLSF_PREFIX, tlsf_pool_overhead)
+#define tlsf_provider_mmap TLSF_PASTE(TLSF_PREFIX, tlsf_provider_mmap)
+#define tlsf_provider_munmap TLSF_PASTE(TLSF_PREFIX, tlsf_provider_munmap)
+#define tlsf_realloc TLSF_PASTE(TLSF_PREFIX, tlsf_realloc)
+#define tlsf_remove_pool TLSF_PASTE(TLSF_PREFIX, tlsf_remove_pool)
+#define tlsf_reset TLSF_PASTE(TLSF_PREFIX, tlsf_reset)
+#define tlsf_set_fit TLSF_PASTE(TLSF_PREFIX, tlsf_set_fit)
+#define tlsf_set_growth TLSF_PASTE(TLSF_PREFIX, tlsf_set_growth)
+#define tlsf_set_huge TLSF_PASTE(TLSF_PREFIX, tlsf_set_huge)
+#define tlsf_set_placement TLSF_PASTE(TLSF_PREFIX, tlsf_set_placement)
+#define tlsf_set_provider TLSF_PASTE(TLSF_PREFIX, tlsf_set_provider)
+#define tlsf_set_quick TLSF_PASTE(TLSF_PREFIX, tlsf_set_quick)
+#define tlsf_sharded_count TLSF_PASTE(TLSF_PREFIX, tlsf_sharded_count)
+#define tlsf_sharded_create TLSF_PASTE(TLSF_PREFIX, tlsf_sharded_create)
+#define tlsf_sharded_create_with_pool TLSF_PASTE(TLSF_PREFIX, tlsf_sharded_create_with_pool)
+#define tlsf_sharded_destroy TLSF_PASTE(TLSF_PREFIX, tlsf_sharded_destroy)
+#define tlsf_sharded_free TLSF_PASTE(TLSF_PREFIX, tlsf_sharded_free)
+#define tlsf_sharded_heap TLSF_PASTE(TLSF_PREFIX, tlsf_sharded_heap)
+#define tlsf_sharded_malloc TLSF_PASTE(TLSF_PREFIX, tlsf_sharded_malloc)
+#define tlsf_sharded_memalign TLSF_PASTE(TLSF_PREFIX, tlsf_sharded_memalign)
+#define tlsf_sharded_realloc TLSF_PASTE(TLSF_PREFIX, tlsf_sharded_realloc)
+#define tlsf_sharded_size TLSF_PASTE(TLSF_PREFIX, tlsf_sharded_size)
+#define tlsf_size TLSF_PASTE(TLSF_PREFIX, tlsf_size)
+#define tlsf_slab_enable TLSF_PASTE(TLSF_PREFIX, tlsf_slab_enable)
+#define tlsf_trim TLSF_PASTE(TLSF_PREFIX, tlsf_trim)
+#define tlsf_unmap_pool TLSF_PASTE(TLSF_PREFIX, tlsf_unmap_pool)
+#define tlsf_walk_pool TLSF_PASTE(TLSF_PREFIX, tlsf_walk_pool)
+#endif
+
 #if defined(__cplusplus)
 extern "C" {
 #endif
@@ -50,22 +131,292 @@ extern "C" {
 typedef struct tlsf tlsf_t;
 typedef struct tlsf_pool tlsf_pool_t;
 
+/* tlsf_cache_t: a per-thread cache of small blocks in front of a tlsf_t */
+typedef struct tlsf_cache tlsf_cache_t;
+typedef void (*tlsf_lock_fn)(void *user);
+
+/* Region providers: map and unmap memory for new pools of a heap */
+typedef void *(*tlsf_map_fn)(size_t bytes, void *user);
+typedef void (*tlsf_unmap_fn)(void *mem, size_t bytes, void *user);
+
+/* tlsf_sharded_t: N locked heaps, selected per CPU or per thread */
+typedef struct tlsf_sharded tlsf_sharded_t;
+
+/* tlsf_arena_t: bump-pointer allocation from chunks of a tlsf_t */
+typedef struct tlsf_arena tlsf_arena_t;
+
+/* Position in an arena, see tlsf_arena_mark */
+typedef struct tlsf_arena_mark {
+	void *chunk;
+	char *bump;
+} tlsf_arena_mark_t;
+
+enum tlsf_shard_policy {
+	TLSF_SHARD_BY_CPU = 0,
+	TLSF_SHARD_BY_THREAD = 1,
+};
+
+/* Free list order, see tlsf_set_placement */
+enum tlsf_placement {
+	/* Freed blocks go to the head of their free list */
+	TLSF_PLACE_LIFO = 0,
+	/* Free lists are kept sorted by address, so that allocations gather
+	 * at the start of each pool */
+	TLSF_PLACE_ADDRESS = 1,
+};
+
+/* Options of tlsf_map_pool */
+enum tlsf_map_flags {
+	/* Fault all pages in up front */
+	TLSF_MAP_POPULATE = 1 << 0,
+	/* Lock the pages in memory, fail if that is not possible */
+	TLSF_MAP_LOCK = 1 << 1,
+	/* Back the pool with explicit huge pages, if any are reserved */
+	TLSF_MAP_HUGETLB = 1 << 2,
+	/* Ask for transparent huge pages */
+	TLSF_MAP_HUGEPAGE = 1 << 3,
+};
+
+/* Lock contention counters of a heap created with tlsf_create_locked */
+typedef struct tlsf_lock_stats {
+	unsigned long long acquisitions;
+	unsigned long long contended;
+	/* Cycles spent spinning on contended acquisitions, not blocked */
+	unsigned long long spin_cycles;
+} tlsf_lock_stats_t;
+
+/*
+ * Heap counters, maintained when built with TLSF_STATISTIC. Used bytes
+ * include block headers and pool overhead, and blocks held by thread
+ * caches count as used.
+ */
+typedef struct tlsf_stats {
+	size_t pool_bytes;
+	size_t used_bytes;
+	size_t free_bytes;
+	size_t peak_used_bytes;
+	size_t free_blocks;
+	unsigned long long malloc_count;
+	unsigned long long free_count;
+} tlsf_stats_t;
+
+/* Free blocks of one free list, see tlsf_census */
+typedef struct tlsf_bucket {
+	/* Smallest block size held by the list */
+	size_t size;
+	size_t blocks;
+	size_t bytes;
+} tlsf_bucket_t;
+
+typedef struct tlsf_census_summary {
+	size_t free_blocks;
+	size_t free_bytes;
+	size_t largest_block;
+	/* Largest request that is known to succeed, see tlsf_largest_allocatable */
+	size_t largest_allocatable;
+	/* 1 - largest_block / free_bytes: 0 when all free memory is in one block */
+	double fragmentation;
+} tlsf_census_t;
+
+/*
+ * Size class configuration of a build, and its entry points, so that
+ * builds with different TLSF_PREFIX settings can be driven alike.
+ */
+typedef struct tlsf_variant {
+	const char *name;
+	int sl_index_count_log2;
+	int fl_index_max;
+	size_t align_size;
+	tlsf_t *(*create_with_pool)(void *mem, size_t bytes);
+	void (*destroy)(tlsf_t *tlsf);
+	void *(*malloc)(tlsf_t *tlsf, size_t bytes);
+	void *(*memalign)(tlsf_t *tlsf, size_t align, size_t bytes);
+	void *(*realloc)(tlsf_t *tlsf, void *ptr, size_t size);
+	void (*free)(tlsf_t *tlsf, void *ptr);
+	size_t (*block_size)(void *ptr);
+	void (*census)(tlsf_t *tlsf, tlsf_bucket_t *buckets, tlsf_census_t *census);
+	/* Size of the control structure */
+	size_t (*size)(void);
+} tlsf_variant_t;
+
 /* Create/destroy a memory pool */
 tlsf_t *tlsf_create(void *mem);
 tlsf_t *tlsf_create_with_pool(void *mem, size_t bytes);
 void tlsf_destroy(tlsf_t *tlsf);
 tlsf_pool_t *tlsf_get_pool(tlsf_t *tlsf);
 
-/* Add/remove memory pools */
+/* Create a heap whose public entry points are serialized on a lock */
+tlsf_t *tlsf_create_locked(void *mem);
+tlsf_t *tlsf_create_with_pool_locked(void *mem, size_t bytes);
+void tlsf_get_lock_stats(tlsf_t *tlsf, tlsf_lock_stats_t *stats);
+
+/*
+ * Add/remove memory pools. Builds with TLSF_OOB_LINKS keep a link table
+ * at the end of each pool, which takes 1/128 of its size on 64-bit.
+ * Builds with TLSF_COMPACT_CONTROL only take pools that lie within 16 GB
+ * of the control structure on 64-bit. Builds with TLSF_COMPACT_HEADER
+ * do not take a pool that shares a 4 kB page with a pool of another heap.
+ */
 tlsf_pool_t *tlsf_add_pool(tlsf_t *tlsf, void *mem, size_t bytes);
+/*
+ * Add a pool whose memory is zero filled, e.g. fresh from mmap. tlsf_calloc
+ * does not clear its pages again, nor the pages purged by tlsf_trim.
+ */
+tlsf_pool_t *tlsf_add_pool_zeroed(tlsf_t *tlsf, void *mem, size_t bytes);
 void tlsf_remove_pool(tlsf_t *tlsf, tlsf_pool_t *pool);
 
-/* malloc/memalign/realloc/free replacements */
+/*
+ * Free all blocks of the heap at once, leaving each pool one free block,
+ * at a cost per pool rather than per allocation. Blocks held by thread
+ * caches must be flushed first, and huge allocations freed one by one.
+ * A slab arena is carved anew.
+ */
+void tlsf_reset(tlsf_t *tlsf);
+
+/*
+ * Growing heaps: when no free block fits a request, a new pool is mapped
+ * from the region provider. Pool sizes start at initial and are multiplied
+ * by factor, until the pools of the heap add up to max_bytes (0: no limit).
+ * Mapped pools are unmapped by tlsf_destroy. tlsf_provider_mmap/munmap
+ * map anonymous memory. With TLSF_COMPACT_CONTROL, tlsf_provider_mmap
+ * pools are placed near the control structure; a pool from another
+ * provider that lands out of reach stops the growth of the heap.
+ */
+void tlsf_set_provider(tlsf_t *tlsf, tlsf_map_fn map, tlsf_unmap_fn unmap, void *user);
+void tlsf_set_growth(tlsf_t *tlsf, size_t initial, unsigned int factor, size_t max_bytes);
+void *tlsf_provider_mmap(size_t bytes, void *user);
+void tlsf_provider_munmap(void *mem, size_t bytes, void *user);
+
+/*
+ * Placement tuning. With a nonzero probe, a request first looks at up to
+ * probe blocks of its own size class before taking a block of the next
+ * class, which always fits. A free block is only split when the remainder
+ * holds at least split_min bytes. Both default to 0. tlsf_set_placement
+ * selects the tlsf_placement order of blocks freed from then on.
+ */
+void tlsf_set_fit(tlsf_t *tlsf, unsigned int probe, size_t split_min);
+void tlsf_set_placement(tlsf_t *tlsf, int policy);
+
+/*
+ * Deferred coalescing: small blocks are freed onto quick lists per size
+ * class, uncoalesced, and serve the next requests of their class. A class
+ * is coalesced once it holds max_blocks blocks, and all classes once the
+ * lists hold more than max_bytes (0: no limit), or when a request would
+ * fail otherwise. Blocks on the quick lists count as used. max_blocks 0,
+ * the default, disables it.
+ */
+void tlsf_set_quick(tlsf_t *tlsf, unsigned int max_blocks, size_t max_bytes);
+
+/*
+ * Huge allocations: requests of at least threshold bytes get an anonymous
+ * mapping of their own instead of a pool block. tlsf_free unmaps them and
+ * tlsf_realloc resizes them with mremap; below half the threshold they
+ * move back into the pools. 0, the default, disables them. Their bytes
+ * are not part of the heap counters.
+ */
+void tlsf_set_huge(tlsf_t *tlsf, size_t threshold);
+
+/*
+ * Map memory for a pool with the given tlsf_map_flags. The pool must be
+ * unmapped with the same size and flags.
+ */
+void *tlsf_map_pool(size_t bytes, int flags);
+void tlsf_unmap_pool(void *mem, size_t bytes, int flags);
+
+/*
+ * Return the pages inside free blocks to the system, leaving up to
+ * keep_bytes of free blocks resident. Empty pools mapped by the region
+ * provider are unmapped. Returns the number of bytes purged or unmapped.
+ */
+size_t tlsf_trim(tlsf_t *tlsf, size_t keep_bytes);
+
+/* malloc/calloc/memalign/realloc/free replacements */
 void *tlsf_malloc(tlsf_t *tlsf, size_t bytes);
+void *tlsf_calloc(tlsf_t *tlsf, size_t count, size_t bytes);
 void *tlsf_memalign(tlsf_t *tlsf, size_t align, size_t bytes);
 void *tlsf_realloc(tlsf_t *tlsf, void *ptr, size_t size);
 void tlsf_free(tlsf_t *tlsf, void *ptr);
 
+/*
+ * Allocate or free count blocks in one heap operation. tlsf_malloc_batch
+ * returns how many of the blocks it could allocate into ptrs. The array
+ * passed to tlsf_free_batch is reordered.
+ */
+size_t tlsf_malloc_batch(tlsf_t *tlsf, size_t bytes, size_t count, void **ptrs);
+void tlsf_free_batch(tlsf_t *tlsf, void **ptrs, size_t count);
+
+/*
+ * Cross-thread frees: queue a block for its owning heap without locking
+ * it. The owner releases queued blocks on its next malloc/free, or when
+ * draining explicitly. tlsf_free on a foreign heap queues as well.
+ */
+void tlsf_free_remote(void *ptr);
+void tlsf_drain_remote(tlsf_t *tlsf);
+
+/*
+ * Thread caches: each thread owns one, and the heap is only entered on a
+ * miss. The optional lock/unlock callbacks guard the heap on a miss; they
+ * are not needed for heaps created with tlsf_create_locked.
+ */
+size_t tlsf_cache_size(void);
+tlsf_cache_t *tlsf_cache_create(void *mem, tlsf_t *tlsf,
+	tlsf_lock_fn lock, tlsf_lock_fn unlock, void *user);
+void tlsf_cache_destroy(tlsf_cache_t *cache);
+void tlsf_cache_flush(tlsf_cache_t *cache);
+void *tlsf_cache_malloc(tlsf_cache_t *cache, size_t bytes);
+void tlsf_cache_free(tlsf_cache_t *cache, void *ptr);
+
+/*
+ * Sharded heaps: route each request to the shard of the current CPU or
+ * thread, falling back to the other shards when it is exhausted. Pools
+ * can be added to individual shards through tlsf_sharded_heap.
+ */
+size_t tlsf_sharded_size(int count);
+tlsf_sharded_t *tlsf_sharded_create(void *mem, int count, int policy);
+tlsf_sharded_t *tlsf_sharded_create_with_pool(void *mem, size_t bytes, int count, int policy);
+void tlsf_sharded_destroy(tlsf_sharded_t *sharded);
+int tlsf_sharded_count(tlsf_sharded_t *sharded);
+tlsf_t *tlsf_sharded_heap(tlsf_sharded_t *sharded, int index);
+void *tlsf_sharded_malloc(tlsf_sharded_t *sharded, size_t bytes);
+void *tlsf_sharded_memalign(tlsf_sharded_t *sharded, size_t align, size_t bytes);
+void *tlsf_sharded_realloc(tlsf_sharded_t *sharded, void *ptr, size_t size);
+void tlsf_sharded_free(tlsf_sharded_t *sharded, void *ptr);
+
+/*
+ * Arenas: allocations are carved from chunks of chunk_bytes taken from the
+ * heap, without a per-object header, and cannot be freed one by one.
+ * Larger requests get a chunk of their own. tlsf_arena_rewind frees all
+ * that was allocated after tlsf_arena_mark, returning the chunks chained
+ * since then to the heap; tlsf_arena_destroy returns all of them. An arena
+ * is used by one thread at a time.
+ */
+size_t tlsf_arena_size(void);
+tlsf_arena_t *tlsf_arena_create(void *mem, tlsf_t *tlsf, size_t chunk_bytes);
+void tlsf_arena_destroy(tlsf_arena_t *arena);
+void *tlsf_arena_malloc(tlsf_arena_t *arena, size_t bytes);
+void *tlsf_arena_memalign(tlsf_arena_t *arena, size_t align, size_t bytes);
+void tlsf_arena_mark(tlsf_arena_t *arena, tlsf_arena_mark_t *mark);
+void tlsf_arena_rewind(tlsf_arena_t *arena, const tlsf_arena_mark_t *mark);
+
+/*
+ * Serve allocations below the small block size from slab pages carved
+ * out of a single block of the given size, without a per-object header.
+ * Returns nonzero if the arena cannot be allocated or is already set up.
+ */
+int tlsf_slab_enable(tlsf_t *tlsf, size_t bytes);
+
+/* Returns nonzero if the heap counters are not compiled in */
+int tlsf_get_stats(tlsf_t *tlsf, tlsf_stats_t *stats);
+
+/*
+ * Free list census. buckets, if not NULL, receives tlsf_census_size()
+ * entries, one per free list in increasing size order. The largest
+ * allocatable size is found from the free list bitmaps alone.
+ */
+size_t tlsf_census_size(void);
+void tlsf_census(tlsf_t *tlsf, tlsf_bucket_t *buckets, tlsf_census_t *census);
+size_t tlsf_largest_allocatable(tlsf_t *tlsf);
+
 /* Returns internal block size, not original request size */
 size_t tlsf_block_size(void *ptr);
 
@@ -80,6 +431,9 @@ size_t tlsf_block_size_max(void);
 size_t tlsf_pool_overhead(void);
 size_t tlsf_alloc_overhead(void);
 
+/* Returns the configuration of this build */
+const tlsf_variant_t *tlsf_get_variant(void);
+
 /* Debugging */
 typedef void (*tlsf_walker)(void *ptr, size_t size, int used, void *user);
 void tlsf_walk_pool(tlsf_pool_t *pool, tlsf_walker walker, void *user);
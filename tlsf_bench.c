@@ -42,6 +42,9 @@
 
 /* tlsf lib */
 #include "tlsf.h"
+/* tlsf size class variants, built with their own prefix (see Makefile.am) */
+const tlsf_variant_t *sl4_tlsf_get_variant(void);
+const tlsf_variant_t *sl6_tlsf_get_variant(void);
 /* tlsf lib (original) */
 #include "tlsf_ori.h"
 
@@ -52,8 +55,11 @@
 /* tlsf wrapper for convenience */
 typedef struct _wtlsf_t  {
   tlsf_t *tlsf_ptr;
+  const tlsf_variant_t *variant;
   char *mem;
   size_t size;
+  // allocations that could not be satisfied
+  size_t failed;
 } wtlsf_t;
 
 /* tlsf original wrapper for convenience */
@@ -86,6 +92,7 @@ typedef enum _bench_type_t {
   BENCH_NATIVE = 2,
   BENCH_TLSF_ORI = 3,
   BENCH_ALL = 4,
+  BENCH_TLSF_VARIANTS = 5,
 } bench_type_t;
 
 /* type of allocator to use */
@@ -179,12 +186,19 @@ FILE *log_fp = NULL;
 // benchmark type (default is tlsf only)
 bench_type_t bench_type = BENCH_TLSF;
 
+// tlsf variants compared by BENCH_TLSF_VARIANTS
+const tlsf_variant_t *(*tlsf_variants[])(void) = {
+  tlsf_get_variant,
+  sl4_tlsf_get_variant,
+  sl6_tlsf_get_variant,
+};
+
 // trace dump related
 char *dump_dir = "./traces";                                  // dump directory
 char *dump_ext = "csv";                                       // dump extension
 char *log_dir = "./logs";                                     // log directory
 char *log_ext = "log";                                        // log directory
-char *dump_tlsf_trace_suffix = "tlsf_mem_trace_out";          // tlsf suffix trace 
+char *dump_tlsf_trace_suffix = "_mem_trace_out";              // tlsf suffix trace, after the variant name
 char *dump_tlsf_ori_trace_suffix = "tlsf_ori_mem_trace_out";  // tlsf ori. suffix trace
 char *dump_native_trace_suffix = "native_mem_trace_out";      // native suffix trace 
 
@@ -213,7 +227,8 @@ Available arguments:\n\
  -c core_id: set affinity to a specific core\n\
  -t ops: the number of ops to run (must be > min ops)\n\
  -p infile: parse and execute a plan\n\
- -t trial_flag: custom trial (tlsf: 1, native: 2, tlsf_ori: 3, all: 4)\n\
+ -b bench_flag: allocators to bench (tlsf: 1, tlsf_ori: 2, native: 3, all: 4,\n\
+    tlsf size class variants: 5)\n\
  -i: interactive, see progress every 10 %\n\
  -l: enable runtime logging to file\n";
 
@@ -682,6 +697,11 @@ parse_args(int argc, char **argv) {
               bench_type = BENCH_ALL;
               break;
             }
+            case 5: {
+              log_fun(" ** Benching TLSF size class variants\n");
+              bench_type = BENCH_TLSF_VARIANTS;
+              break;
+            }
             default: {
               log_fun(" !! Error could not parse valid bench flag using default\n");
               break;
@@ -817,28 +837,30 @@ alloc_mem(size_t size) {
   if(size < min_pool_size) {
     log_fun(" !! Size was below min threshold which is %zu bytes\n", min_pool_size);
     return NULL;
-  } else if((mem = calloc(sizeof(char), size)) == NULL) {
+  }
+  log_fun(" -- Allocating and warming up memory...\n");
+  // let the kernel prefault the pages, backed by huge pages if it can
+  if((mem = tlsf_map_pool(size, TLSF_MAP_POPULATE | TLSF_MAP_HUGEPAGE)) == NULL) {
     log_fun(" !! Requested memory failed to yield, aborting\n");
     return NULL;
-  } else {
-    log_fun(" -- Ghostly allocated memory of size: %lf MB\n", 1.0*size / mb_div);
-  }
-  log_fun(" -- Warming up memory...\n");
-  // forcefully request memory
-  char *mem_addr = mem;
-  for (int i = 0; i < size; ++i) {
-    *mem_addr = 0;
-    mem_addr++;
   }
   log_fun(" -- Returning warmed-up memory of size: %lf MB\n", 1.0*size / mb_div);
   return mem;
 }
 
+/**
+ * Function that returns memory obtained through alloc_mem.
+ */
+void
+free_mem(char *mem, size_t size) {
+  tlsf_unmap_pool(mem, size, TLSF_MAP_POPULATE | TLSF_MAP_HUGEPAGE);
+}
+
 /**
  * This function is responsible for creating the tlsf pool structure 
  */
 tlsf_t *
-create_tlsf_pool(wtlsf_t *pool, size_t size) {
+create_tlsf_pool(wtlsf_t *pool, size_t size, const tlsf_variant_t *variant) {
   // check for valid input
   if(pool == NULL) {
     log_fun(" !! No pool provided\n");
@@ -849,8 +871,9 @@ create_tlsf_pool(wtlsf_t *pool, size_t size) {
     log_fun(" !! Pool must be at least of size %zu and requested: %zu\n", 
       min_pool_size, size);
   }
-  // set the size
+  // set the size and the build to use
   pool->size = size;
+  pool->variant = variant;
   // try to allocate (warm) memory
   if((pool->mem = alloc_mem(pool->size)) == NULL) {
     log_fun(" !! Failed to allocate and warm-up memory, cannot continue\n");
@@ -858,9 +881,10 @@ create_tlsf_pool(wtlsf_t *pool, size_t size) {
   }
 
   // now, actually try to create tlsf
-  log_fun(" -- Attempting to create tlsf pool of size: %zu MB \n", 
-    (1.0*pool->size)/mb_div);
-  pool->tlsf_ptr = tlsf_create_with_pool(pool->mem, pool->size);
+  log_fun(" -- Attempting to create %s pool of size: %lf MB (sl log2: %d, fl max: %d, align: %zu)\n", 
+    variant->name, (1.0*pool->size)/mb_div, variant->sl_index_count_log2,
+    variant->fl_index_max, variant->align_size);
+  pool->tlsf_ptr = variant->create_with_pool(pool->mem, pool->size);
   if(pool->tlsf_ptr == NULL) {
     log_fun(" !! Failed to create tlsf pool\n");
   } else {
@@ -885,11 +909,11 @@ destroy_tlsf_pool(wtlsf_t *pool) {
   log_fun(" -- Destroying tlsf pool of size %zu\n", pool->size);
   // first, destroy the pool
   if(pool->tlsf_ptr) {
-    tlsf_destroy(pool->tlsf_ptr);
+    pool->variant->destroy(pool->tlsf_ptr);
   }
   // then free the memory block from the OS
   if(pool->mem) {
-    free(pool->mem);
+    free_mem(pool->mem, pool->size);
     pool->mem = NULL;
   }
 }
@@ -948,7 +972,7 @@ destroy_tlsf_ori_pool(wtlsf_ori_t *pool) {
   }
   // then free the memory block from the OS
   if(pool->mem) {
-    free(pool->mem);
+    free_mem(pool->mem, pool->size);
     pool->mem = NULL;
   }
 }
@@ -983,7 +1007,7 @@ bench_seq(wtlsf_t *pool, wtlsf_ori_t *ori_pool, alloc_plan_t *plan) {
       //log_fun(" -- Allocating block at %d with size %zu bytes\n", 
       //  i, plan->block_size[i]);
       if(pool != NULL) {
-        plan->mem_ptr[mem_pivot] = tlsf_malloc(pool->tlsf_ptr, plan->block_size[i]);  
+        plan->mem_ptr[mem_pivot] = pool->variant->malloc(pool->tlsf_ptr, plan->block_size[i]);  
       } else if(ori_pool != NULL) {
         plan->mem_ptr[mem_pivot] = malloc_ex(plan->block_size[i], ori_pool->mem);
       } else {
@@ -995,7 +1019,7 @@ bench_seq(wtlsf_t *pool, wtlsf_ori_t *ori_pool, alloc_plan_t *plan) {
       int free_blk = (int) plan->block_id[i];
       //log_fun(" -- Freeing block at %d\n", free_blk);
       if(pool != NULL) {
-        tlsf_free(pool->tlsf_ptr, plan->mem_ptr[free_blk]);
+        pool->variant->free(pool->tlsf_ptr, plan->mem_ptr[free_blk]);
       } else if(ori_pool != NULL) {
         free_ex(plan->mem_ptr[free_blk], ori_pool->mem);
       } else {
@@ -1012,6 +1036,10 @@ bench_seq(wtlsf_t *pool, wtlsf_ori_t *ori_pool, alloc_plan_t *plan) {
     timed_seg = toc(t_ctx, NULL, NULL);
     // add the timed segment to the timing array
     plan->timings[i] = timed_seg;
+    // count failed allocations, outside of the timed segment
+    if(pool != NULL && plan->slot_type[i] == SLOT_MALLOC && plan->mem_ptr[mem_pivot - 1] == NULL) {
+      pool->failed++;
+    }
     // report progress
     if(i % prog_steps_div == 0) {
       cur_time = time(NULL);
@@ -1057,7 +1085,7 @@ bench_custom(wtlsf_t *pool, wtlsf_ori_t *ori_pool, alloc_plan_t *plan) {
     if(plan->slot_type[i] == SLOT_MALLOC) {
       // allocate the block to the designated slot
       if(pool != NULL) {
-        plan->mem_ptr[mem_pivot] = tlsf_malloc(pool->tlsf_ptr, 
+        plan->mem_ptr[mem_pivot] = pool->variant->malloc(pool->tlsf_ptr, 
         plan->block_size[i]);        
       } else if(ori_pool != NULL) {
         plan->mem_ptr[mem_pivot] = malloc_ex(plan->block_size[i], ori_pool->mem);  
@@ -1069,7 +1097,7 @@ bench_custom(wtlsf_t *pool, wtlsf_ori_t *ori_pool, alloc_plan_t *plan) {
     } else if(plan->slot_type[i] == SLOT_FREE) {
       // free the block
       if(pool != NULL) {
-        tlsf_free(pool->tlsf_ptr, plan->mem_ptr[plan->block_id[i]]);
+        pool->variant->free(pool->tlsf_ptr, plan->mem_ptr[plan->block_id[i]]);
       } else if(ori_pool != NULL) {
         free_ex(plan->mem_ptr[plan->block_id[i]], ori_pool->mem);
       } else {
@@ -1084,6 +1112,10 @@ bench_custom(wtlsf_t *pool, wtlsf_ori_t *ori_pool, alloc_plan_t *plan) {
     timed_seg = toc(t_ctx, NULL, NULL);
     // add the timed segment to the timing array
     plan->timings[i] = timed_seg;
+    // count failed allocations, outside of the timed segment
+    if(pool != NULL && plan->slot_type[i] == SLOT_MALLOC && plan->mem_ptr[mem_pivot - 1] == NULL) {
+      pool->failed++;
+    }
   }
   assert(mem_pivot == plan->plan_size / 2);
 }
@@ -1159,6 +1191,14 @@ allocation of %lf MB; cannot continue\n",
       plan->plan_size, elapsed);
   }
   log_fun(" -- xput: %Lf [malloc/free] ops/cycle\n", plan->plan_size/elapsed);
+  // report how well the free memory held together
+  if(pool != NULL) {
+    tlsf_census_t census;
+    pool->variant->census(pool->tlsf_ptr, NULL, &census);
+    log_fun(" -- failed allocations: %zu, free blocks: %zu, largest free block: %lf MB, \
+fragmentation: %lf\n", pool->failed, census.free_blocks,
+      (1.0*census.largest_block)/mb_div, census.fragmentation);
+  }
 }
 
 /**
@@ -1675,10 +1715,10 @@ print_plan(alloc_plan_t *plan) {
  * an existing trace.
  */
 void 
-execute_plan(use_alloc_type_t alloc_type) {
+execute_plan(use_alloc_type_t alloc_type, const tlsf_variant_t *variant) {
   // start hint
   if(alloc_type == USE_TLSF) {
-    log_fun("\n ## Executing plan using tlsf allocator\n\n");    
+    log_fun("\n ## Executing plan using %s allocator\n\n", variant->name);    
   } else if(alloc_type == USE_TLSF_ORI) {
     log_fun("\n ## Executing plan using tlsf (original) allocator\n\n");
   } else if(alloc_type == USE_NATIVE) {
@@ -1718,7 +1758,7 @@ execute_plan(use_alloc_type_t alloc_type) {
     // declare our pool structure
     wtlsf_t pool = {0};
     // create the pool
-    if(create_tlsf_pool(&pool, pool_size) == NULL) {
+    if(create_tlsf_pool(&pool, pool_size, variant) == NULL) {
       log_fun(" !! Error: fatal error encountered when creating the pool\n");
       ret = false;
     } else {  
@@ -1751,7 +1791,9 @@ execute_plan(use_alloc_type_t alloc_type) {
     if(alloc_type == USE_NATIVE) {
       dump_plan(&plan, fname_buf, dump_native_trace_suffix); 
     } else if(alloc_type == USE_TLSF) {
-      dump_plan(&plan, fname_buf, dump_tlsf_trace_suffix); 
+      char suffix_buf[MAX_FNAME_BUF];
+      snprintf(suffix_buf, sizeof(suffix_buf), "%s%s", variant->name, dump_tlsf_trace_suffix);
+      dump_plan(&plan, fname_buf, suffix_buf); 
     } else if(alloc_type == USE_TLSF_ORI) {
       dump_plan(&plan, fname_buf, dump_tlsf_ori_trace_suffix);  
     }
@@ -1761,7 +1803,7 @@ execute_plan(use_alloc_type_t alloc_type) {
   destroy_alloc_plan(&plan);
   // finish hint
   if(alloc_type == USE_TLSF) {
-    log_fun("\n ## Finished executing plan using tlsf allocator\n");    
+    log_fun("\n ## Finished executing plan using %s allocator\n", variant->name);    
   } else if(alloc_type == USE_TLSF_ORI) {
     log_fun("\n ## Finished executing plan using tlsf (original) allocator\n");
   } else if(alloc_type == USE_NATIVE) {
@@ -1826,31 +1868,39 @@ run_bench() {
   switch(bench_type) {
     case BENCH_TLSF: {
       // use tlsf allocator
-      execute_plan(USE_TLSF);
+      execute_plan(USE_TLSF, tlsf_get_variant());
       break;
     }
     case BENCH_NATIVE: {
       // use native allocator
-      execute_plan(USE_NATIVE);
+      execute_plan(USE_NATIVE, NULL);
       break;
     }
     case BENCH_TLSF_ORI: {
       // use tlsf original allocator
-      execute_plan(USE_TLSF_ORI);
+      execute_plan(USE_TLSF_ORI, NULL);
       break;
     }
     case BENCH_ALL: {
       // use native allocator
-      execute_plan(USE_NATIVE);
+      execute_plan(USE_NATIVE, NULL);
       // use tlsf allocator
-      execute_plan(USE_TLSF);
+      execute_plan(USE_TLSF, tlsf_get_variant());
       // use tlsf original allocator
-      execute_plan(USE_TLSF_ORI);
+      execute_plan(USE_TLSF_ORI, NULL);
+      break;
+    }
+    case BENCH_TLSF_VARIANTS: {
+      // use each tlsf variant on the same plan
+      for(size_t i = 0; i < sizeof(tlsf_variants) / sizeof(tlsf_variants[0]); ++i) {
+        srand(2);
+        execute_plan(USE_TLSF, tlsf_variants[i]());
+      }
       break;
     }
     default: {
       // use tlsf allocator
-      execute_plan(USE_TLSF);
+      execute_plan(USE_TLSF, tlsf_get_variant());
       break;
     }
   }